@@ -90,313 +90,5289 @@
 #include <string>
 #include <sstream>
 #include <ctime>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <stdint.h>
+#include <algorithm>
+#include <deque>
+#include <list>
+#include <map>
+#include <new>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CPPUT_HAS_THREADS 1
+#define CPPUT_HAS_FORK 1
+#define CPPUT_HAS_MMAP 1
+#define CPPUT_HAS_REGEX 1
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#if defined(__GLIBC__) || defined(__APPLE__)
+#define CPPUT_HAS_BACKTRACE 1
+#include <execinfo.h>
+#endif
+
+#if defined(__linux__)
+#define CPPUT_HAS_PERF_EVENTS 1
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__)
+#define CPPUT_HAS_AFFINITY 1
+#include <sched.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__) && defined(__linux__)
+#define CPPUT_HAS_TSC 1
+#include <cpuid.h>
+#endif
+
+#if defined(__GNUC__)
+#define CPPUT_THREAD_LOCAL __thread
+#else
+#define CPPUT_THREAD_LOCAL
+#endif
 
 namespace cpput
 {
 
-struct ResultWriter
+/// Hardware event counts. Counters that the kernel or the CPU does not
+/// provide, e.g. inside most virtual machines, stay zero and their bit in
+/// available is clear.
+struct PerfCounters
+{
+  enum Counter
+  {
+    Instructions = 1 << 0,
+    Cycles       = 1 << 1,
+    CacheMisses  = 1 << 2,
+    BranchMisses = 1 << 3,
+    LlcMisses    = 1 << 4
+  };
+
+  enum { count = 5 };
+
+  PerfCounters()
+    : instructions(0)
+    , cycles(0)
+    , cacheMisses(0)
+    , branchMisses(0)
+    , llcMisses(0)
+    , available(0)
+  {
+  }
+
+  /// True if all the given counters were measured.
+  bool has(unsigned counters) const { return counters != 0 && (available & counters) == counters; }
+
+  double get(Counter counter) const
+  {
+    switch (counter)
+    {
+    case Instructions: return instructions;
+    case Cycles:       return cycles;
+    case CacheMisses:  return cacheMisses;
+    case BranchMisses: return branchMisses;
+    case LlcMisses:    return llcMisses;
+    }
+    return 0;
+  }
+
+  void set(Counter counter, double value)
+  {
+    switch (counter)
+    {
+    case Instructions: instructions = value; break;
+    case Cycles:       cycles = value; break;
+    case CacheMisses:  cacheMisses = value; break;
+    case BranchMisses: branchMisses = value; break;
+    case LlcMisses:    llcMisses = value; break;
+    }
+    available |= counter;
+  }
+
+  static const char* name(Counter counter)
+  {
+    switch (counter)
+    {
+    case Instructions: return "instructions";
+    case Cycles:       return "cycles";
+    case CacheMisses:  return "cache_misses";
+    case BranchMisses: return "branch_misses";
+    case LlcMisses:    return "llc_misses";
+    }
+    return "";
+  }
+
+  /// Returns the counts divided by n, e.g. per iteration.
+  PerfCounters per(double n) const
+  {
+    PerfCounters c;
+    for (unsigned i = 0; i < count; ++i)
+    {
+      const Counter counter = static_cast<Counter>(1 << i);
+      if (has(counter))
+        c.set(counter, n > 0 ? get(counter) / n : 0);
+    }
+    return c;
+  }
+
+  double instructions;
+  double cycles;
+  double cacheMisses;      ///< references missing the caches, as the CPU defines them
+  double branchMisses;
+  double llcMisses;        ///< last level cache read misses
+  unsigned available;      ///< bitwise or of the measured Counter values
+};
+
+/// Counts hardware events of the calling thread, and of threads it starts
+/// while counting, with perf_event_open on Linux. Each counter is opened on
+/// its own, so a missing one does not disable the others, and is scaled
+/// when the kernel had to multiplex it. Elsewhere nothing is counted.
+class PerfProbe
+{
+public:
+  PerfProbe()
+  {
+    for (unsigned i = 0; i < PerfCounters::count; ++i)
+      fds_[i] = -1;
+  }
+
+  ~PerfProbe()
+  {
+    close();
+  }
+
+  /// Whether tests and benchmarks collect counters, set by --perf-counters.
+  static bool& enabled()
+  {
+    static bool e = false;
+    return e;
+  }
+
+  /// Opens the counters on first use and starts counting from zero.
+  void start()
+  {
+#ifdef CPPUT_HAS_PERF_EVENTS
+    for (unsigned i = 0; i < PerfCounters::count; ++i)
+    {
+      if (fds_[i] < 0)
+        fds_[i] = open(static_cast<PerfCounters::Counter>(1 << i));
+      if (fds_[i] >= 0)
+      {
+        ioctl(fds_[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(fds_[i], PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+#endif
+  }
+
+  /// Counts since start(); counting continues.
+  PerfCounters read() const
+  {
+    PerfCounters c;
+#ifdef CPPUT_HAS_PERF_EVENTS
+    for (unsigned i = 0; i < PerfCounters::count; ++i)
+    {
+      uint64_t values[3];   // value, time enabled, time running
+      if (fds_[i] < 0 || ::read(fds_[i], values, sizeof(values)) != static_cast<ssize_t>(sizeof(values)) || values[2] == 0)
+        continue;
+      c.set(static_cast<PerfCounters::Counter>(1 << i),
+            static_cast<double>(values[0]) * values[1] / values[2]);
+    }
+#endif
+    return c;
+  }
+
+private:
+#ifdef CPPUT_HAS_PERF_EVENTS
+  static int open(PerfCounters::Counter counter)
+  {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    switch (counter)
+    {
+    case PerfCounters::Instructions: attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+    case PerfCounters::Cycles:       attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+    case PerfCounters::CacheMisses:  attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+    case PerfCounters::BranchMisses: attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+    case PerfCounters::LlcMisses:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                  | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      break;
+    }
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+  }
+#endif
+
+  void close()
+  {
+    for (unsigned i = 0; i < PerfCounters::count; ++i)
+    {
+#ifdef CPPUT_HAS_PERF_EVENTS
+      if (fds_[i] >= 0)
+        ::close(fds_[i]);
+#endif
+      fds_[i] = -1;
+    }
+  }
+
+  PerfProbe(const PerfProbe& other);
+  PerfProbe& operator=(const PerfProbe& rhs);
+
+  int fds_[PerfCounters::count];
+};
+
+/// Resources used by a single test.
+struct TestMetrics
+{
+  TestMetrics()
+    : wallTime(0)
+    , cpuTime(0)
+    , voluntaryContextSwitches(0)
+    , involuntaryContextSwitches(0)
+    , minorPageFaults(0)
+    , majorPageFaults(0)
+    , maxResidentSetSize(0)
+    , bytesProcessed(0)
+    , itemsProcessed(0)
+  {
+  }
+
+  double wallTime;                 ///< seconds on the monotonic clock
+  double cpuTime;                  ///< seconds of CPU time of the test's thread
+  long   voluntaryContextSwitches;
+  long   involuntaryContextSwitches;
+  long   minorPageFaults;
+  long   majorPageFaults;
+  long   maxResidentSetSize;       ///< peak of the process in kilobytes
+  PerfCounters counters;           ///< with --perf-counters
+  double bytesProcessed;           ///< declared with SET_BYTES_PROCESSED
+  double itemsProcessed;           ///< declared with SET_ITEMS_PROCESSED
+};
+
+/// Measures the TestMetrics between its construction (or restart()) and
+/// elapsed(). Context switches and page faults are counted for the calling
+/// thread where the platform supports it (Linux) and for the whole process
+/// otherwise.
+class MetricsProbe
+{
+public:
+  MetricsProbe() { sample(start_); }
+
+  void restart()
+  {
+    if (PerfProbe::enabled())
+      perf_.start();
+    sample(start_);
+  }
+
+  TestMetrics elapsed() const
+  {
+    Sample now;
+    sample(now);
+    TestMetrics m;
+    m.wallTime = now.wall - start_.wall;
+    m.cpuTime = now.cpu - start_.cpu;
+    m.voluntaryContextSwitches = now.voluntaryContextSwitches - start_.voluntaryContextSwitches;
+    m.involuntaryContextSwitches = now.involuntaryContextSwitches - start_.involuntaryContextSwitches;
+    m.minorPageFaults = now.minorPageFaults - start_.minorPageFaults;
+    m.majorPageFaults = now.majorPageFaults - start_.majorPageFaults;
+    m.maxResidentSetSize = now.maxResidentSetSize;
+    if (PerfProbe::enabled())
+      m.counters = perf_.read();
+    return m;
+  }
+
+private:
+  struct Sample
+  {
+    double wall;
+    double cpu;
+    long   voluntaryContextSwitches;
+    long   involuntaryContextSwitches;
+    long   minorPageFaults;
+    long   majorPageFaults;
+    long   maxResidentSetSize;
+  };
+
+  static void sample(Sample& s)
+  {
+#ifdef CPPUT_HAS_THREADS
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    s.wall = ts.tv_sec + ts.tv_nsec * 1e-9;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    s.cpu = ts.tv_sec + ts.tv_nsec * 1e-9;
+
+    rusage usage;
+#ifdef RUSAGE_THREAD
+    getrusage(RUSAGE_THREAD, &usage);
+#else
+    getrusage(RUSAGE_SELF, &usage);
+#endif
+    s.voluntaryContextSwitches = usage.ru_nvcsw;
+    s.involuntaryContextSwitches = usage.ru_nivcsw;
+    s.minorPageFaults = usage.ru_minflt;
+    s.majorPageFaults = usage.ru_majflt;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    s.maxResidentSetSize = usage.ru_maxrss / 1024;
+#else
+    s.maxResidentSetSize = usage.ru_maxrss;
+#endif
+#else
+    s.wall = s.cpu = static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+    s.voluntaryContextSwitches = s.involuntaryContextSwitches = 0;
+    s.minorPageFaults = s.majorPageFaults = s.maxResidentSetSize = 0;
+#endif
+  }
+
+private:
+  Sample    start_;
+  PerfProbe perf_;
+};
+
+// ----------------------------------------------------------------------------
+
+/// Returns the p-th percentile (0..100) of sorted values by nearest rank.
+inline double percentile(const std::vector<double>& sorted, double p)
+{
+  if (sorted.empty())
+    return 0;
+  std::size_t rank = static_cast<std::size_t>(p / 100 * sorted.size() + 0.999999);
+  if (rank == 0)
+    rank = 1;
+  return sorted[std::min(rank, sorted.size()) - 1];
+}
+
+/// Summary of a set of samples.
+struct Statistics
+{
+  Statistics() : mean(0), median(0), stddev(0), min(0), max(0) {}
+
+  double mean;
+  double median;
+  double stddev;   ///< sample standard deviation
+  double min;
+  double max;
+};
+
+inline Statistics computeStatistics(std::vector<double> samples)
+{
+  Statistics stats;
+  if (samples.empty())
+    return stats;
+  std::sort(samples.begin(), samples.end());
+  const std::size_t n = samples.size();
+  double sum = 0;
+  for (std::size_t i = 0; i < n; ++i)
+    sum += samples[i];
+  stats.mean = sum / n;
+  stats.median = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+  double squares = 0;
+  for (std::size_t i = 0; i < n; ++i)
+    squares += (samples[i] - stats.mean) * (samples[i] - stats.mean);
+  stats.stddev = n > 1 ? std::sqrt(squares / (n - 1)) : 0;
+  stats.min = samples.front();
+  stats.max = samples.back();
+  return stats;
+}
+
+/// Formats a duration in seconds with three significant digits and the
+/// largest unit that keeps the number at or above one, e.g. "12.3 ns".
+inline std::string formatDuration(double seconds)
+{
+  static const char* const units[] = { "s", "ms", "us", "ns" };
+  std::size_t unit = 0;
+  while (unit < 3 && seconds != 0 && std::fabs(seconds) < 1)
+  {
+    seconds *= 1000;
+    unit++;
+  }
+  std::ostringstream out;
+  out << std::setprecision(3) << seconds << ' ' << units[unit];
+  return out.str();
+}
+
+/// Outcome of a benchmark. Times are per iteration in seconds, summarized
+/// over the repetitions of the measurement.
+struct BenchmarkResult
+{
+  BenchmarkResult()
+    : iterations(0), repetitions(0), range(0), threads(1), coldIterations(0)
+    , bytesPerSecond(0), itemsPerSecond(0), warmupIterations(0), warmupTime(0), steady(true)
+    , systemLoad(0), unreliable(false), allocationsCounted(false), allocations(0), allocatedBytes(0)
+  {
+  }
+
+  std::string className;
+  std::string name;
+  std::size_t iterations;    ///< iterations per repetition and thread
+  std::size_t repetitions;
+  std::size_t range;         ///< input size of a range benchmark, else 0
+  std::size_t threads;       ///< threads running the body concurrently
+  Statistics  time;
+  PerfCounters counters;     ///< per iteration and thread, with --perf-counters
+  std::size_t coldIterations; ///< iterations per repetition of the cold run, 0 if none
+  Statistics  coldTime;      ///< per iteration with caches evicted before each
+  double      bytesPerSecond; ///< at the median time, 0 unless the body declared bytes
+  double      itemsPerSecond; ///< at the median time, 0 unless the body declared items
+  std::size_t warmupIterations; ///< run before measuring, 0 without warmup
+  double      warmupTime;    ///< seconds spent warming up
+  bool        steady;        ///< false if warmup stopped at the time limit
+  double      systemLoad;    ///< share of the CPUs used by other processes meanwhile
+  bool        unreliable;    ///< systemLoad exceeded the noise threshold
+  bool        allocationsCounted; ///< with CPPUT_COUNT_ALLOCATIONS
+  double      allocations;   ///< heap allocations per iteration and thread
+  double      allocatedBytes; ///< bytes allocated per iteration and thread
+};
+
+/// Complementary error function with a fractional error below 1.2e-7
+/// (Chebyshev fit from Numerical Recipes); erfc() is not in C++98.
+inline double complementaryErrorFunction(double x)
+{
+  const double z = std::fabs(x);
+  const double t = 1 / (1 + 0.5 * z);
+  const double result = t * std::exp(-z * z - 1.26551223 + t * (1.00002368 + t * (0.37409196
+      + t * (0.09678418 + t * (-0.18628806 + t * (0.27886807 + t * (-1.13520398
+      + t * (1.48851587 + t * (-0.82215223 + t * 0.17087277)))))))));
+  return x >= 0 ? result : 2 - result;
+}
+
+/// Two-sided p-value of the Mann-Whitney U test that the samples come from
+/// the same distribution, using the normal approximation with correction
+/// for ties.
+inline double mannWhitneyPValue(const std::vector<double>& a, const std::vector<double>& b)
+{
+  const std::size_t n1 = a.size();
+  const std::size_t n2 = b.size();
+  if (n1 == 0 || n2 == 0)
+    return 1;
+  std::vector<std::pair<double, std::size_t> > all;
+  for (std::size_t i = 0; i < n1; ++i)
+    all.push_back(std::make_pair(a[i], 0));
+  for (std::size_t i = 0; i < n2; ++i)
+    all.push_back(std::make_pair(b[i], 1));
+  std::sort(all.begin(), all.end());
+
+  const double n = static_cast<double>(n1 + n2);
+  double rankSum = 0;
+  double ties = 0;
+  for (std::size_t i = 0; i < all.size();)
+  {
+    std::size_t j = i;
+    while (j < all.size() && all[j].first == all[i].first)
+      ++j;
+    const double rank = (i + 1 + j) / 2.0;   // average of ranks i+1 .. j
+    for (std::size_t k = i; k < j; ++k)
+      if (all[k].second == 0)
+        rankSum += rank;
+    const double t = static_cast<double>(j - i);
+    ties += t * t * t - t;
+    i = j;
+  }
+
+  const double u = rankSum - n1 * (n1 + 1) / 2.0;
+  const double mu = n1 * n2 / 2.0;
+  const double sigma = std::sqrt(n1 * n2 / 12.0 * ((n + 1) - ties / (n * (n - 1))));
+  if (sigma == 0)
+    return 1;
+  const double z = std::max(0.0, std::fabs(u - mu) - 0.5) / sigma;
+  // The approximation of erfc is slightly above one at zero.
+  return std::min(1.0, complementaryErrorFunction(z / std::sqrt(2.0)));
+}
+
+/// Outcome of an interleaved comparison of two benchmarks. Times are per
+/// iteration in seconds; a speedup above one means the candidate is faster.
+struct ComparisonResult
+{
+  ComparisonResult() : rounds(0), speedup(0), speedupLow(0), speedupHigh(0), pValue(1) {}
+
+  std::string className;
+  std::string name;
+  std::string baseline;
+  std::string candidate;
+  std::size_t rounds;
+  Statistics  baselineTime;
+  Statistics  candidateTime;
+  double      speedup;        ///< ratio of the median times, baseline / candidate
+  double      speedupLow;     ///< bounds of the 95% bootstrap confidence interval
+  double      speedupHigh;
+  double      pValue;         ///< Mann-Whitney U test
+
+  /// True when the difference is unlikely to be noise: the p-value is below
+  /// 0.05 and the confidence interval does not include one.
+  bool significant() const
+  {
+    return pValue < 0.05 && (speedupLow > 1 || speedupHigh < 1);
+  }
+};
+
+/// Compares per-iteration times of a baseline and a candidate. The
+/// confidence interval of the speedup comes from resampling both sets of
+/// samples with a fixed seed, so the result is reproducible.
+inline ComparisonResult compareSamples(const std::vector<double>& baseline,
+                                       const std::vector<double>& candidate)
+{
+  ComparisonResult result;
+  result.rounds = std::min(baseline.size(), candidate.size());
+  result.baselineTime = computeStatistics(baseline);
+  result.candidateTime = computeStatistics(candidate);
+  if (result.rounds == 0 || result.candidateTime.median <= 0)
+    return result;
+  result.speedup = result.baselineTime.median / result.candidateTime.median;
+  result.pValue = mannWhitneyPValue(baseline, candidate);
+
+  const std::size_t resamples = 2000;
+  uint64_t seed = (static_cast<uint64_t>(0x9E3779B9) << 32) | 0x7F4A7C15;
+  std::vector<double> speedups;
+  std::vector<double> a(baseline.size());
+  std::vector<double> b(candidate.size());
+  for (std::size_t r = 0; r < resamples; ++r)
+  {
+    for (std::size_t i = 0; i < a.size(); ++i)
+    {
+      seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+      a[i] = baseline[seed % baseline.size()];
+    }
+    for (std::size_t i = 0; i < b.size(); ++i)
+    {
+      seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+      b[i] = candidate[seed % candidate.size()];
+    }
+    const double median = computeStatistics(b).median;
+    if (median > 0)
+      speedups.push_back(computeStatistics(a).median / median);
+  }
+  std::sort(speedups.begin(), speedups.end());
+  result.speedupLow = percentile(speedups, 2.5);
+  result.speedupHigh = percentile(speedups, 97.5);
+  return result;
+}
+
+/// Histogram of latencies in nanoseconds with log-linear buckets, in the
+/// style of HdrHistogram: values below 128 are counted exactly and every
+/// power of two above is split into 64 buckets, so values are kept to
+/// within 1.6% in a fixed 30 KB regardless of their range.
+class LatencyHistogram
+{
+public:
+  enum
+  {
+    exactValues = 128,
+    subBuckets = 64,
+    bucketCount = exactValues + 57 * subBuckets
+  };
+
+  LatencyHistogram()
+    : counts_(bucketCount, 0)
+    , count_(0)
+    , min_(~static_cast<uint64_t>(0))
+    , max_(0)
+    , sum_(0)
+  {
+  }
+
+  void record(uint64_t value, uint64_t count = 1)
+  {
+    counts_[indexOf(value)] += count;
+    count_ += count;
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+    sum_ += static_cast<double>(value) * count;
+  }
+
+  /// Records value and corrects for coordinated omission: when a loop
+  /// meant to run every expectedInterval stalls for value, the requests
+  /// that would have been issued during the stall are recorded with the
+  /// latencies they would have seen.
+  void recordCorrected(uint64_t value, uint64_t expectedInterval)
+  {
+    record(value);
+    if (expectedInterval == 0)
+      return;
+    for (uint64_t missed = value > expectedInterval ? value - expectedInterval : 0;
+         missed >= expectedInterval; missed -= expectedInterval)
+      record(missed);
+  }
+
+  void add(const LatencyHistogram& other)
+  {
+    for (std::size_t i = 0; i < counts_.size(); ++i)
+      counts_[i] += other.counts_[i];
+    count_ += other.count_;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+    sum_ += other.sum_;
+  }
+
+  uint64_t count() const { return count_; }
+  uint64_t min() const { return count_ ? min_ : 0; }
+  uint64_t max() const { return max_; }
+  double mean() const { return count_ ? sum_ / count_ : 0; }
+
+  /// Returns the value at or below which p percent (0..100) of the recorded
+  /// values lie, as the highest value of its bucket.
+  uint64_t percentile(double p) const
+  {
+    if (count_ == 0)
+      return 0;
+    uint64_t rank = static_cast<uint64_t>(p / 100 * count_ + 0.999999);
+    rank = std::max<uint64_t>(1, std::min(rank, count_));
+    uint64_t seen = 0;
+    for (std::size_t i = 0; i < counts_.size(); ++i)
+    {
+      seen += counts_[i];
+      if (seen >= rank)
+        return std::min(highestEquivalent(i), max_);
+    }
+    return max_;
+  }
+
+  /// Number of recorded values in each bucket, see highestEquivalent().
+  const std::vector<uint64_t>& buckets() const { return counts_; }
+
+  static std::size_t indexOf(uint64_t value)
+  {
+    if (value < exactValues)
+      return static_cast<std::size_t>(value);
+    int top = 63;
+    while (!(value >> top))
+      --top;
+    const int shift = top - 6;   // value >> shift is in [64, 128)
+    return exactValues + (shift - 1) * subBuckets + static_cast<std::size_t>((value >> shift) - subBuckets);
+  }
+
+  /// Highest value counted in the bucket at index.
+  static uint64_t highestEquivalent(std::size_t index)
+  {
+    if (index < exactValues)
+      return index;
+    const int shift = static_cast<int>((index - exactValues) / subBuckets) + 1;
+    const uint64_t lowest = static_cast<uint64_t>((index - exactValues) % subBuckets + subBuckets) << shift;
+    return lowest + ((static_cast<uint64_t>(1) << shift) - 1);
+  }
+
+private:
+  std::vector<uint64_t> counts_;
+  uint64_t              count_;
+  uint64_t              min_;
+  uint64_t              max_;
+  double                sum_;
+};
+
+/// Latency distribution of a BENCHMARK_LATENCY in seconds per iteration.
+struct LatencyResult
+{
+  LatencyResult()
+    : count(0), corrected(false), mean(0), p50(0), p90(0), p99(0), p999(0), max(0)
+  {
+  }
+
+  std::string      className;
+  std::string      name;
+  uint64_t         count;       ///< recorded iterations, including corrections
+  bool             corrected;   ///< coordinated omission was corrected
+  double           mean;
+  double           p50;
+  double           p90;
+  double           p99;
+  double           p999;
+  double           max;
+  LatencyHistogram histogram;   ///< in nanoseconds
+};
+
+/// Summarizes a histogram of nanoseconds.
+inline LatencyResult summarizeLatency(const LatencyHistogram& histogram)
+{
+  LatencyResult result;
+  result.count = histogram.count();
+  result.mean = histogram.mean() * 1e-9;
+  result.p50 = histogram.percentile(50) * 1e-9;
+  result.p90 = histogram.percentile(90) * 1e-9;
+  result.p99 = histogram.percentile(99) * 1e-9;
+  result.p999 = histogram.percentile(99.9) * 1e-9;
+  result.max = histogram.max() * 1e-9;
+  result.histogram = histogram;
+  return result;
+}
+
+/// Formats a rate per second with an SI prefix, e.g. "12.3 M/s" or, with
+/// unit "B", "1.5 GB/s".
+inline std::string formatRate(double perSecond, const char* unit = "")
+{
+  static const char* const prefixes[] = { "", "k", "M", "G", "T" };
+  std::size_t prefix = 0;
+  while (prefix < 4 && perSecond >= 1000)
+  {
+    perSecond /= 1000;
+    prefix++;
+  }
+  std::ostringstream out;
+  out << std::setprecision(3) << perSecond << ' ' << prefixes[prefix] << unit << "/s";
+  return out.str();
+}
+
+/// Throughput of a threaded benchmark at one thread count.
+struct ScalingPoint
+{
+  ScalingPoint() : threads(0), throughput(0), perThread(0), efficiency(0), negative(false) {}
+
+  std::size_t threads;
+  double      throughput;    ///< iterations per second of all threads together
+  double      perThread;     ///< iterations per second of one thread
+  double      efficiency;    ///< throughput relative to linear scaling, 1 is perfect
+  bool        negative;      ///< over 5% less throughput than the previous thread count
+};
+
+/// How the throughput of a threaded benchmark scales with its threads.
+struct ScalingResult
+{
+  std::string               className;
+  std::string               name;
+  std::vector<ScalingPoint> points;
+
+  bool negativeScaling() const
+  {
+    for (std::size_t i = 0; i < points.size(); ++i)
+      if (points[i].negative)
+        return true;
+    return false;
+  }
+};
+
+/// Computes the scaling from the thread counts and the median seconds per
+/// iteration of one thread at each count. Efficiency is relative to the
+/// per-thread throughput at the lowest count.
+inline ScalingResult computeScaling(const std::vector<std::size_t>& threads,
+                                    const std::vector<double>& times)
+{
+  // Throughput within this fraction of the previous count is run-to-run
+  // noise rather than negative scaling.
+  const double tolerance = 0.05;
+  ScalingResult result;
+  for (std::size_t i = 0; i < threads.size() && i < times.size(); ++i)
+  {
+    ScalingPoint point;
+    point.threads = threads[i];
+    point.perThread = times[i] > 0 ? 1 / times[i] : 0;
+    point.throughput = point.perThread * threads[i];
+    if (!result.points.empty())
+    {
+      const ScalingPoint& first = result.points.front();
+      point.efficiency = first.perThread > 0 ? point.perThread / first.perThread : 0;
+      point.negative = point.throughput < result.points.back().throughput * (1 - tolerance);
+    }
+    else
+      point.efficiency = 1;
+    result.points.push_back(point);
+  }
+  return result;
+}
+
+/// Where the replacement operator new of CPPUT_COUNT_ALLOCATIONS takes the
+/// memory of a benchmark loop from.
+enum Allocator
+{
+  /// malloc, with the loop timed as a whole.
+  DefaultAllocator,
+  /// malloc, with every turn of the loop timed on its own like the arenas.
+  MallocAllocator,
+  /// Bump allocation from a region on normal pages, reset after every turn.
+  ArenaAllocator,
+  /// Like ArenaAllocator on transparent huge pages.
+  HugePageAllocator
+};
+
+inline const char* allocatorName(Allocator allocator)
+{
+  static const char* const names[] = { "malloc", "malloc", "arena", "huge_pages" };
+  return names[allocator];
+}
+
+/// Median seconds per iteration of a BENCHMARK_ALLOCATORS under each
+/// allocator, in the order they ran.
+struct AllocatorsResult
+{
+  AllocatorsResult() : hugePages(true) {}
+
+  std::string            className;
+  std::string            name;
+  std::vector<Allocator> allocators;
+  std::vector<double>    times;
+  /// False if the system has transparent huge pages disabled, so that the
+  /// huge page arena runs on normal pages.
+  bool                   hugePages;
+
+  /// Speedup of the allocator at index over the first one, usually malloc.
+  double speedup(std::size_t index) const
+  {
+    return times[index] > 0 ? times[0] / times[index] : 0;
+  }
+};
+
+/// Asymptotic complexities that can be fitted to benchmark times, in
+/// increasing order of growth.
+enum Complexity
+{
+  O1,
+  OLogN,
+  ON,
+  ONLogN,
+  ON2,
+  /// No declared bound.
+  OAny
+};
+
+inline const char* complexityName(Complexity complexity)
+{
+  static const char* const names[] = { "O(1)", "O(log n)", "O(n)", "O(n log n)", "O(n^2)", "any" };
+  return names[complexity];
+}
+
+inline double complexityValue(Complexity complexity, double n)
+{
+  switch (complexity)
+  {
+  case O1:     return 1;
+  case OLogN:  return std::log(n);
+  case ON:     return n;
+  case ONLogN: return n * std::log(n);
+  case ON2:    return n * n;
+  default:     return 1;
+  }
+}
+
+/// Complexity fitted to the times of a range benchmark.
+struct ComplexityResult
+{
+  ComplexityResult() : complexity(O1), bound(OAny), coefficient(0), rms(0) {}
+
+  std::string className;
+  std::string name;
+  Complexity  complexity;
+  Complexity  bound;
+  double      coefficient;   ///< seconds per unit of the complexity function
+  double      rms;           ///< root mean square error relative to the mean time
+
+  /// True when the fitted complexity grows faster than the declared bound.
+  bool exceedsBound() const { return bound != OAny && complexity > bound; }
+};
+
+/// Fits time = coefficient * f(n) by least squares for every complexity and
+/// picks the one with the smallest error.
+inline ComplexityResult fitComplexity(const std::vector<double>& sizes,
+                                      const std::vector<double>& times)
+{
+  ComplexityResult best;
+  if (sizes.empty() || sizes.size() != times.size())
+    return best;
+  double mean = 0;
+  for (std::size_t i = 0; i < times.size(); ++i)
+    mean += times[i];
+  mean /= times.size();
+
+  bool first = true;
+  for (int c = O1; c < OAny; ++c)
+  {
+    const Complexity complexity = static_cast<Complexity>(c);
+    double products = 0;
+    double squares = 0;
+    for (std::size_t i = 0; i < sizes.size(); ++i)
+    {
+      const double f = complexityValue(complexity, sizes[i]);
+      products += f * times[i];
+      squares += f * f;
+    }
+    const double coefficient = squares > 0 ? products / squares : 0;
+    double error = 0;
+    for (std::size_t i = 0; i < sizes.size(); ++i)
+    {
+      const double residual = times[i] - coefficient * complexityValue(complexity, sizes[i]);
+      error += residual * residual;
+    }
+    const double rms = mean > 0 ? std::sqrt(error / sizes.size()) / mean : 0;
+    if (first || rms < best.rms)
+    {
+      best.complexity = complexity;
+      best.coefficient = coefficient;
+      best.rms = rms;
+      first = false;
+    }
+  }
+  return best;
+}
+
+// ----------------------------------------------------------------------------
+
+struct ResultWriter
+{
+  virtual ~ResultWriter() {}
+  
+  virtual void startTest(const std::string& className, const std::string& name) = 0;
+  virtual void endTest(bool success) = 0;
+
+  /// Called with the resources used by the test right before endTest().
+  virtual void metrics(const TestMetrics&) {}
+
+  /// Called with the measurements of a benchmark before its metrics().
+  virtual void benchmark(const BenchmarkResult&) {}
+
+  /// Called with the complexity fitted to a range benchmark. It is reported
+  /// as a test of its own named "<name>/BigO".
+  virtual void complexity(const ComplexityResult&) {}
+
+  /// Called with the outcome of a BENCHMARK_COMPARE.
+  virtual void comparison(const ComparisonResult&) {}
+
+  /// Called with the latency distribution of a BENCHMARK_LATENCY, after
+  /// benchmark().
+  virtual void latency(const LatencyResult&) {}
+
+  /// Called with the scaling of a threaded benchmark. It is reported as a
+  /// test of its own named "<name>/scaling".
+  virtual void scaling(const ScalingResult&) {}
+
+  /// Called with the times of a BENCHMARK_ALLOCATORS under each allocator.
+  /// It is reported as a test of its own named "<name>/allocators".
+  virtual void allocators(const AllocatorsResult&) {}
+  
+  virtual void failure(const std::string& filename, std::size_t line, const std::string& message) = 0;
+  virtual int getNumberOfFailures() const = 0;
+};
+
+// ----------------------------------------------------------------------------
+
+/// Collects test durations and reports the slowest tests and groups and the
+/// distribution of test times. Adding a test costs one vector append.
+class TimingReport
+{
+public:
+  void add(const std::string& className, const std::string& name, double seconds)
+  {
+    entries_.push_back(Entry(className, name, seconds));
+  }
+
+  std::size_t size() const { return entries_.size(); }
+
+  void print(std::ostream& out, std::size_t count) const
+  {
+    if (entries_.empty())
+      return;
+
+    std::vector<Entry> tests(entries_);
+    std::sort(tests.begin(), tests.end());
+    std::map<std::string, Entry> groupTotals;
+    std::vector<double> durations;
+    double total = 0;
+    for (std::size_t i = 0; i < tests.size(); ++i)
+    {
+      Entry& group = groupTotals[tests[i].className];
+      group.className = tests[i].className;
+      group.seconds += tests[i].seconds;
+      group.tests++;
+      durations.push_back(tests[i].seconds);
+      total += tests[i].seconds;
+    }
+    std::vector<Entry> groups;
+    for (std::map<std::string, Entry>::const_iterator it = groupTotals.begin(); it != groupTotals.end(); ++it)
+      groups.push_back(it->second);
+    std::sort(groups.begin(), groups.end());
+    std::sort(durations.begin(), durations.end());
+
+    const std::ios::fmtflags flags = out.flags();
+    const std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(6);
+
+    out << "\nSlowest " << std::min(count, tests.size()) << " of " << tests.size() << " tests:\n";
+    for (std::size_t i = 0; i < count && i < tests.size(); ++i)
+      out << std::setw(12) << tests[i].seconds << " s  " << tests[i].className << '.' << tests[i].name << '\n';
+
+    out << "Slowest " << std::min(count, groups.size()) << " of " << groups.size() << " groups:\n";
+    for (std::size_t i = 0; i < count && i < groups.size(); ++i)
+      out << std::setw(12) << groups[i].seconds << " s  " << groups[i].className
+          << " (" << groups[i].tests << " tests)\n";
+
+    out << "Test time p50 " << percentile(durations, 50)
+        << " s, p90 " << percentile(durations, 90)
+        << " s, p99 " << percentile(durations, 99)
+        << " s, total " << total << " s\n";
+
+    out.flags(flags);
+    out.precision(precision);
+  }
+
+private:
+  struct Entry
+  {
+    Entry() : seconds(0), tests(0) {}
+    Entry(const std::string& c, const std::string& n, double s) : className(c), name(n), seconds(s), tests(1) {}
+
+    // Slowest first, ties in name order to keep the report stable.
+    bool operator<(const Entry& rhs) const
+    {
+      if (seconds != rhs.seconds)
+        return seconds > rhs.seconds;
+      if (className != rhs.className)
+        return className < rhs.className;
+      return name < rhs.name;
+    }
+
+    std::string className;
+    std::string name;
+    double      seconds;
+    std::size_t tests;
+  };
+
+  std::vector<Entry> entries_;
+};
+
+// ----------------------------------------------------------------------------
+
+class TextResultWriter : public ResultWriter
+{
+public:
+  TextResultWriter()
+    : testCount_(0)
+    , failures_(0)
+    , slowest_(0)
+    , benchmark_(false)
+  {
+  }
+
+  virtual ~TextResultWriter()
+  {
+    if (slowest_ > 0)
+      timings_.print(std::cout, slowest_);
+    if (failures_ == 0)
+    {
+      std::cout << "\nAll tests pass.\n";
+      return;
+    }
+    std::cout << "\n" << failures_ << " out of " << testCount_ << " tests failed.\n";
+  }
+
+  /// Prints the given number of slowest tests and groups and the test time
+  /// percentiles at the end of the run; 0 disables the report.
+  void setSlowestReport(std::size_t count) { slowest_ = count; }
+
+  virtual void startTest(const std::string& className, const std::string& name)
+  {
+    testCount_++;
+    benchmark_ = false;
+    className_ = className;
+    name_ = name;
+  }
+
+  virtual void benchmark(const BenchmarkResult& r)
+  {
+    const FormatGuard guard;
+    benchmark_ = true;
+    std::cout << std::left << std::setw(48) << (r.className + "." + r.name) << std::right
+              << " mean " << std::setw(9) << formatDuration(r.time.mean)
+              << "  median " << std::setw(9) << formatDuration(r.time.median)
+              << "  stddev " << std::setw(9) << formatDuration(r.time.stddev)
+              << "  min " << std::setw(9) << formatDuration(r.time.min)
+              << "  (" << r.repetitions << " x " << r.iterations << ")";
+    throughput(r.bytesPerSecond, r.itemsPerSecond);
+    if (r.warmupIterations > 0)
+      std::cout << "  warmup " << r.warmupIterations << " in " << formatDuration(r.warmupTime)
+                << (r.steady ? "" : ", not steady");
+    if (r.allocationsCounted)
+      std::cout << "  allocations " << std::setprecision(3) << r.allocations
+                << " (" << r.allocatedBytes << " B)";
+    if (r.unreliable)
+      std::cout << "  unreliable: other processes used " << std::setprecision(3)
+                << r.systemLoad * 100 << "% of the CPUs";
+    std::cout << "\n";
+    if (r.coldIterations > 0)
+      std::cout << std::left << std::setw(48) << "  cold cache" << std::right
+                << " mean " << std::setw(9) << formatDuration(r.coldTime.mean)
+                << "  median " << std::setw(9) << formatDuration(r.coldTime.median)
+                << "  stddev " << std::setw(9) << formatDuration(r.coldTime.stddev)
+                << "  min " << std::setw(9) << formatDuration(r.coldTime.min)
+                << "  (" << r.repetitions << " x " << r.coldIterations << ")\n";
+    if (r.counters.available)
+    {
+      std::cout << std::left << std::setw(48) << "" << std::right << std::setprecision(3);
+      for (unsigned i = 0; i < PerfCounters::count; ++i)
+      {
+        const PerfCounters::Counter counter = static_cast<PerfCounters::Counter>(1 << i);
+        if (r.counters.has(counter))
+          std::cout << ' ' << PerfCounters::name(counter) << ' ' << r.counters.get(counter);
+      }
+      if (r.counters.has(PerfCounters::Instructions | PerfCounters::Cycles) && r.counters.cycles > 0)
+        std::cout << " IPC " << r.counters.instructions / r.counters.cycles;
+      std::cout << " per iteration\n";
+    }
+  }
+
+  virtual void complexity(const ComplexityResult& r)
+  {
+    const FormatGuard guard;
+    benchmark_ = true;
+    std::cout << std::left << std::setw(48) << (r.className + "." + r.name) << std::right
+              << " " << complexityName(r.complexity)
+              << "  coefficient " << formatDuration(r.coefficient)
+              << "  rms " << std::setprecision(3) << r.rms * 100 << "%\n";
+  }
+
+  virtual void comparison(const ComparisonResult& r)
+  {
+    const FormatGuard guard;
+    benchmark_ = true;
+    std::cout << std::left << std::setw(48) << (r.className + "." + r.name) << std::right
+              << " speedup " << std::setprecision(3) << r.speedup << "x"
+              << " [" << r.speedupLow << ", " << r.speedupHigh << "]"
+              << "  p " << std::setprecision(2) << r.pValue
+              << (r.significant() ? "  significant" : "  not significant")
+              << "  (" << r.baseline << " " << formatDuration(r.baselineTime.median)
+              << ", " << r.candidate << " " << formatDuration(r.candidateTime.median)
+              << ", " << r.rounds << " rounds)\n";
+  }
+
+  virtual void latency(const LatencyResult& r)
+  {
+    std::cout << std::left << std::setw(48) << "" << std::right
+              << " p50  " << std::setw(9) << formatDuration(r.p50)
+              << "  p90    " << std::setw(9) << formatDuration(r.p90)
+              << "  p99    " << std::setw(9) << formatDuration(r.p99)
+              << "  p99.9 " << std::setw(9) << formatDuration(r.p999)
+              << "  max " << formatDuration(r.max)
+              << "  (" << r.count << (r.corrected ? " samples, corrected)\n" : " samples)\n");
+  }
+
+  virtual void scaling(const ScalingResult& r)
+  {
+    const FormatGuard guard;
+    benchmark_ = true;
+    std::cout << r.className << "." << r.name << "\n";
+    for (std::size_t i = 0; i < r.points.size(); ++i)
+    {
+      const ScalingPoint& p = r.points[i];
+      std::cout << std::setw(6) << p.threads << " threads  "
+                << std::setw(10) << formatRate(p.throughput) << " total  "
+                << std::setw(10) << formatRate(p.perThread) << " per thread  efficiency "
+                << std::setprecision(3) << p.efficiency * 100 << "%"
+                << (p.negative ? "  negative scaling" : "") << "\n";
+    }
+  }
+
+  virtual void allocators(const AllocatorsResult& r)
+  {
+    const FormatGuard guard;
+    benchmark_ = true;
+    std::cout << std::left << std::setw(48) << (r.className + "." + r.name) << std::right;
+    for (std::size_t i = 0; i < r.allocators.size(); ++i)
+    {
+      std::cout << (i > 0 ? "  " : " ") << allocatorName(r.allocators[i]) << ' ' << formatDuration(r.times[i]);
+      if (i > 0)
+        std::cout << " (" << std::setprecision(3) << r.speedup(i) << "x)";
+    }
+    std::cout << (r.hugePages ? "\n" : "  transparent huge pages disabled\n");
+  }
+
+  virtual void metrics(const TestMetrics& m)
+  {
+    if (slowest_ > 0)
+      timings_.add(className_, name_, m.wallTime);
+    if (!benchmark_ && (m.bytesProcessed > 0 || m.itemsProcessed > 0) && m.wallTime > 0)
+    {
+      benchmark_ = true;
+      std::cout << std::left << std::setw(48) << (className_ + "." + name_) << std::right
+                << " time " << std::setw(9) << formatDuration(m.wallTime);
+      throughput(m.bytesProcessed / m.wallTime, m.itemsProcessed / m.wallTime);
+      std::cout << "\n";
+    }
+  }
+
+  virtual void endTest(bool success)
+  {
+    if (!success)
+      std::cout << 'F';
+    else if (!benchmark_)
+      std::cout << '.';
+  }
+
+  virtual void failure(const std::string& filename, std::size_t line, const std::string& message)
+  {
+    failures_++;
+    std::cout << "Failure: " << filename << ", line " << line << ": " << message << '\n';
+  }
+
+  virtual int getNumberOfFailures() const { return failures_; }
+
+private:
+  /// Restores the flags and precision of std::cout that a report changes,
+  /// so that user code printing afterwards is not affected.
+  class FormatGuard
+  {
+  public:
+    FormatGuard()
+      : flags_(std::cout.flags())
+      , precision_(std::cout.precision())
+    {
+    }
+
+    ~FormatGuard()
+    {
+      std::cout.flags(flags_);
+      std::cout.precision(precision_);
+    }
+
+  private:
+    FormatGuard(const FormatGuard& other);
+    FormatGuard& operator=(const FormatGuard& rhs);
+
+    std::ios::fmtflags flags_;
+    std::streamsize    precision_;
+  };
+
+  void throughput(double bytesPerSecond, double itemsPerSecond)
+  {
+    if (bytesPerSecond > 0)
+      std::cout << "  bytes " << formatRate(bytesPerSecond, "B");
+    if (itemsPerSecond > 0)
+      std::cout << "  items " << formatRate(itemsPerSecond);
+  }
+
+  int          testCount_;
+  int          failures_;
+  std::size_t  slowest_;
+  bool         benchmark_;
+  std::string  className_;
+  std::string  name_;
+  TimingReport timings_;
+};
+
+// ----------------------------------------------------------------------------
+
+class XmlResultWriter : public ResultWriter
+{
+public:
+  XmlResultWriter()
+    : time_(0)
+    , failureCount_(0)
+  {
+    std::cout << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+    std::cout << "<testsuite>\n";
+  }
+
+  virtual ~XmlResultWriter()
+  {
+    std::cout << "</testsuite>\n";
+  }
+
+  virtual void startTest(const std::string& className, const std::string& name)
+  {
+    className_ = className;
+    name_ = name;
+    time_ = 0;
+    failures_.str("");
+    properties_.str("");
+  }
+
+  virtual void benchmark(const BenchmarkResult& r)
+  {
+    property("iterations", r.iterations);
+    property("repetitions", r.repetitions);
+    property("mean", r.time.mean);
+    property("median", r.time.median);
+    property("stddev", r.time.stddev);
+    property("min", r.time.min);
+    if (r.range != 0)
+      property("range", r.range);
+    if (r.threads > 1)
+      property("threads", r.threads);
+    if (r.bytesPerSecond > 0)
+      property("bytes_per_second", r.bytesPerSecond);
+    if (r.itemsPerSecond > 0)
+      property("items_per_second", r.itemsPerSecond);
+    if (r.warmupIterations > 0)
+    {
+      property("warmup_iterations", r.warmupIterations);
+      property("warmup_time", r.warmupTime);
+      property("steady", r.steady ? "true" : "false");
+    }
+    if (r.allocationsCounted)
+    {
+      property("allocations", r.allocations);
+      property("allocated_bytes", r.allocatedBytes);
+    }
+    property("system_load", r.systemLoad);
+    if (r.unreliable)
+      property("unreliable", "true");
+    if (r.coldIterations > 0)
+    {
+      property("cold_iterations", r.coldIterations);
+      property("cold_mean", r.coldTime.mean);
+      property("cold_median", r.coldTime.median);
+      property("cold_stddev", r.coldTime.stddev);
+      property("cold_min", r.coldTime.min);
+    }
+    counters(r.counters, "_per_iteration");
+  }
+
+  virtual void complexity(const ComplexityResult& r)
+  {
+    property("complexity", complexityName(r.complexity));
+    property("coefficient", r.coefficient);
+    property("rms", r.rms);
+  }
+
+  virtual void comparison(const ComparisonResult& r)
+  {
+    property("baseline", r.baseline);
+    property("candidate", r.candidate);
+    property("rounds", r.rounds);
+    property("baseline_median", r.baselineTime.median);
+    property("candidate_median", r.candidateTime.median);
+    property("speedup", r.speedup);
+    property("speedup_low", r.speedupLow);
+    property("speedup_high", r.speedupHigh);
+    property("p_value", r.pValue);
+  }
+
+  virtual void latency(const LatencyResult& r)
+  {
+    property("samples", r.count);
+    property("corrected", r.corrected ? "true" : "false");
+    property("p50", r.p50);
+    property("p90", r.p90);
+    property("p99", r.p99);
+    property("p99.9", r.p999);
+    property("max", r.max);
+  }
+
+  virtual void scaling(const ScalingResult& r)
+  {
+    for (std::size_t i = 0; i < r.points.size(); ++i)
+    {
+      std::ostringstream prefix;
+      prefix << "threads_" << r.points[i].threads << "_";
+      property((prefix.str() + "throughput").c_str(), r.points[i].throughput);
+      property((prefix.str() + "efficiency").c_str(), r.points[i].efficiency);
+    }
+    property("negative_scaling", r.negativeScaling() ? "true" : "false");
+  }
+
+  virtual void allocators(const AllocatorsResult& r)
+  {
+    for (std::size_t i = 0; i < r.allocators.size(); ++i)
+    {
+      const std::string name = allocatorName(r.allocators[i]);
+      property((name + "_median").c_str(), r.times[i]);
+      property((name + "_speedup").c_str(), r.speedup(i));
+    }
+    property("transparent_huge_pages", r.hugePages ? "true" : "false");
+  }
+
+  virtual void metrics(const TestMetrics& m)
+  {
+    time_ = m.wallTime;
+    counters(m.counters);
+    if (m.bytesProcessed > 0 && m.wallTime > 0)
+      property("bytes_per_second", m.bytesProcessed / m.wallTime);
+    if (m.itemsProcessed > 0 && m.wallTime > 0)
+      property("items_per_second", m.itemsProcessed / m.wallTime);
+  }
+
+  virtual void endTest(bool success)
+  {
+    std::ostringstream time;
+    time << std::fixed << std::setprecision(6) << time_;
+    std::cout << "  <testcase classname=\""
+              << className_
+              << "\" name=\""
+              << name_
+              << "\" time=\""
+              << time.str()
+              << "\"";
+    if (success && properties_.str().empty())
+    {
+      std::cout << "/>\n";
+      return;
+    }
+    // The JUnit schema allows a single properties element per test case, so
+    // everything reported for the test is collected into one.
+    std::cout << ">\n";
+    if (!properties_.str().empty())
+      std::cout << "    <properties>\n"
+                << properties_.str()
+                << "    </properties>\n";
+    std::cout << failures_.str()
+              << "  </testcase>\n";
+  }
+
+  virtual void failure(const std::string& filename, std::size_t line, const std::string& message)
+  {
+    failures_ << "    <failure>"
+              << message
+              << " in "
+              << filename
+              << ", line "
+              << line
+              << "</failure>\n";
+    failureCount_++;
+  }
+
+  virtual int getNumberOfFailures() const
+  {
+    return failureCount_;
+  }
+
+private:
+  void counters(const PerfCounters& c, const char* suffix = "")
+  {
+    if (!c.available)
+      return;
+    for (unsigned i = 0; i < PerfCounters::count; ++i)
+    {
+      const PerfCounters::Counter counter = static_cast<PerfCounters::Counter>(1 << i);
+      if (c.has(counter))
+        property((std::string(PerfCounters::name(counter)) + suffix).c_str(), c.get(counter));
+    }
+  }
+
+  template <typename T>
+  void property(const char* name, T value)
+  {
+    properties_ << "      <property name=\"" << name << "\" value=\"" << value << "\"/>\n";
+  }
+
+private:
+  std::string        className_;
+  std::string        name_;
+  double             time_;
+  std::ostringstream failures_;
+  std::ostringstream properties_;
+  int                failureCount_;
+};
+
+// ----------------------------------------------------------------------------
+
+/// Region that the replacement operator new bump-allocates from while the
+/// loop of a benchmark runs with ArenaAllocator or HugePageAllocator. The
+/// region is reserved on first use and reset after every turn of the loop,
+/// so allocations must not outlive the iteration that made them.
+class BenchmarkArena
+{
+public:
+  /// The arena on huge pages or the one on normal pages.
+  static BenchmarkArena& instance(bool hugePages)
+  {
+    static BenchmarkArena normal(false);
+    static BenchmarkArena huge(true);
+    used() = true;
+    return hugePages ? huge : normal;
+  }
+
+  /// Arena the calling thread allocates from, or 0 for malloc.
+  static BenchmarkArena*& current()
+  {
+    static CPPUT_THREAD_LOCAL BenchmarkArena* current;
+    return current;
+  }
+
+  /// True if p was allocated from an arena, so it must not be freed.
+  static bool owns(const void* p)
+  {
+    return used() && (instance(false).contains(p) || instance(true).contains(p));
+  }
+
+  /// Returns 16-byte aligned memory, or 0 when the arena is exhausted.
+  void* allocate(std::size_t size)
+  {
+    if (!begin_)
+      reserve();
+    size = (std::max<std::size_t>(size, 1) + 15) & ~static_cast<std::size_t>(15);
+    if (!begin_ || static_cast<std::size_t>(end_ - next_) < size)
+      return 0;
+    void* p = next_;
+    next_ += size;
+    return p;
+  }
+
+  bool contains(const void* p) const
+  {
+    const char* c = static_cast<const char*>(p);
+    return begin_ && c >= begin_ && c < end_;
+  }
+
+  char* mark() const { return next_; }
+  void reset(char* mark) { next_ = mark ? mark : begin_; }
+
+  /// Serves the allocations of the calling thread from malloc while it
+  /// lives, so that data the framework keeps, e.g. the failures a writer
+  /// collects inside a benchmark loop, survives the next reset of the arena.
+  class Suspension
+  {
+  public:
+    Suspension()
+      : arena_(current())
+    {
+      current() = 0;
+    }
+
+    ~Suspension() { current() = arena_; }
+
+  private:
+    Suspension(const Suspension& other);
+    Suspension& operator=(const Suspension& rhs);
+
+    BenchmarkArena* arena_;
+  };
+
+private:
+  explicit BenchmarkArena(bool hugePages)
+    : hugePages_(hugePages)
+    , begin_(0)
+    , end_(0)
+    , next_(0)
+  {
+  }
+
+  static bool& used()
+  {
+    static bool used = false;
+    return used;
+  }
+
+  void reserve()
+  {
+#ifdef CPPUT_HAS_MMAP
+    const std::size_t size = 256 << 20;
+    const std::size_t hugePage = 2 << 20;
+    void* region = mmap(0, size + hugePage, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED)
+      return;
+    char* aligned = reinterpret_cast<char*>(
+        (reinterpret_cast<uintptr_t>(region) + hugePage - 1) & ~static_cast<uintptr_t>(hugePage - 1));
+#if defined(MADV_HUGEPAGE) && defined(MADV_NOHUGEPAGE)
+    madvise(aligned, size, hugePages_ ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+#endif
+    end_ = aligned + size;
+    next_ = aligned;
+    begin_ = aligned;
+#endif
+  }
+
+  BenchmarkArena(const BenchmarkArena& other);
+  BenchmarkArena& operator=(const BenchmarkArena& rhs);
+
+  bool  hugePages_;
+  char* begin_;
+  char* end_;
+  char* next_;
+};
+
+// ----------------------------------------------------------------------------
+
+struct Result
+{
+  Result(const std::string& testClassName,
+         const std::string& testName,
+         ResultWriter& out)
+    : out_(out)
+    , pass_(true)
+    , bytesProcessed_(0)
+    , itemsProcessed_(0)
+  {
+    out_.startTest(testClassName, testName);
+    probe_.restart();
+  }
+  
+  ~Result()
+  {
+    metrics_ = probe_.elapsed();
+    metrics_.bytesProcessed = bytesProcessed_;
+    metrics_.itemsProcessed = itemsProcessed_;
+    out_.metrics(metrics_);
+    out_.endTest(pass_);
+  }
+
+  template <typename T, typename U>
+  void addFailure(const char* filename,
+                  std::size_t line,
+                  T expected,
+                  U actual)
+  {
+    BenchmarkArena::Suspension suspension;
+    pass_ = false;
+    std::stringstream ss;
+    ss << std::setprecision(20)
+       << "failed comparison, expected " << expected
+       << " got " << actual << "\n";
+    out_.failure(filename, line, ss.str());
+  }
+
+  void addFailure(const char* filename,
+                  std::size_t line,
+                  const char* message)
+  {
+    BenchmarkArena::Suspension suspension;
+    pass_ = false;
+    out_.failure(filename, line, message);
+  }
+
+  ResultWriter& out_;
+  bool          pass_;
+  MetricsProbe  probe_;
+  TestMetrics   metrics_;
+  double        bytesProcessed_;
+  double        itemsProcessed_;
+};
+
+// ----------------------------------------------------------------------------
+
+/// Records the outcome of a single test so that it can be replayed into
+/// another writer later, e.g. once a test run on a worker thread is next
+/// in registration order.
+class ResultRecorder : public ResultWriter
+{
+public:
+  ResultRecorder()
+    : hasMetrics_(false)
+    , success_(true)
+  {
+  }
+
+  virtual void startTest(const std::string& className, const std::string& name)
+  {
+    className_ = className;
+    name_ = name;
+  }
+
+  virtual void endTest(bool success)
+  {
+    success_ = success;
+  }
+
+  virtual void metrics(const TestMetrics& m)
+  {
+    metrics_ = m;
+    hasMetrics_ = true;
+  }
+
+  virtual void failure(const std::string& filename, std::size_t line, const std::string& message)
+  {
+    failures_.push_back(Failure(filename, line, message));
+  }
+
+  virtual int getNumberOfFailures() const
+  {
+    return static_cast<int>(failures_.size());
+  }
+
+  void replay(ResultWriter& out) const
+  {
+    out.startTest(className_, name_);
+    for (std::size_t i = 0; i < failures_.size(); ++i)
+      out.failure(failures_[i].filename, failures_[i].line, failures_[i].message);
+    if (hasMetrics_)
+      out.metrics(metrics_);
+    out.endTest(success_);
+  }
+
+  /// Serializes the recording, e.g. to send it from a worker process.
+  void encode(std::string& out) const
+  {
+    encodeString(out, className_);
+    encodeString(out, name_);
+    encodeNumber(out, success_ ? 1 : 0);
+    encodeNumber(out, failures_.size());
+    for (std::size_t i = 0; i < failures_.size(); ++i)
+    {
+      encodeString(out, failures_[i].filename);
+      encodeNumber(out, failures_[i].line);
+      encodeString(out, failures_[i].message);
+    }
+    encodeNumber(out, hasMetrics_ ? 1 : 0);
+    out.append(reinterpret_cast<const char*>(&metrics_), sizeof(metrics_));
+  }
+
+  /// Restores a recording made by encode(). Returns false if the data is
+  /// truncated.
+  bool decode(const std::string& in)
+  {
+    std::size_t pos = 0;
+    std::size_t success = 0;
+    std::size_t count = 0;
+    if (!decodeString(in, pos, className_) || !decodeString(in, pos, name_) ||
+        !decodeNumber(in, pos, success) || !decodeNumber(in, pos, count))
+      return false;
+    success_ = success != 0;
+    failures_.clear();
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      Failure f("", 0, "");
+      if (!decodeString(in, pos, f.filename) || !decodeNumber(in, pos, f.line) ||
+          !decodeString(in, pos, f.message))
+        return false;
+      failures_.push_back(f);
+    }
+    std::size_t hasMetrics = 0;
+    if (!decodeNumber(in, pos, hasMetrics) || in.size() - pos < sizeof(metrics_))
+      return false;
+    in.copy(reinterpret_cast<char*>(&metrics_), sizeof(metrics_), pos);
+    hasMetrics_ = hasMetrics != 0;
+    return true;
+  }
+
+private:
+  static void encodeNumber(std::string& out, std::size_t value)
+  {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  static void encodeString(std::string& out, const std::string& value)
+  {
+    encodeNumber(out, value.size());
+    out.append(value);
+  }
+
+  static bool decodeNumber(const std::string& in, std::size_t& pos, std::size_t& value)
+  {
+    if (in.size() - pos < sizeof(value))
+      return false;
+    in.copy(reinterpret_cast<char*>(&value), sizeof(value), pos);
+    pos += sizeof(value);
+    return true;
+  }
+
+  static bool decodeString(const std::string& in, std::size_t& pos, std::string& value)
+  {
+    std::size_t size = 0;
+    if (!decodeNumber(in, pos, size) || in.size() - pos < size)
+      return false;
+    value.assign(in, pos, size);
+    pos += size;
+    return true;
+  }
+
+private:
+  struct Failure
+  {
+    Failure(const std::string& f, std::size_t l, const std::string& m)
+      : filename(f), line(l), message(m) {}
+
+    std::string filename;
+    std::size_t line;
+    std::string message;
+  };
+
+  std::string          className_;
+  std::string          name_;
+  std::vector<Failure> failures_;
+  TestMetrics          metrics_;
+  bool                 hasMetrics_;
+  bool                 success_;
+};
+
+// ----------------------------------------------------------------------------
+
+class Repository;
+
+class Test
+{
+  friend class Repository;
+
+public:
+  /// Copies the strings, so they may be built at run time.
+  Test(const char* className, const char* name, const char* file = "", std::size_t line = 0,
+       unsigned flags = 0, unsigned timeout = 0);
+  virtual ~Test() {}
+
+  enum Flags
+  {
+    /// Never run concurrently with other tests.
+    Serial = 1 << 0,
+    /// Measures performance, only run with --benchmarks.
+    IsBenchmark = 1 << 1
+  };
+
+  void run(ResultWriter& out);
+  
+  Test* next() { return test_unit_next_; }
+
+  const char* getClassName() const { return test_unit_class_name_; }
+  const char* getName() const { return test_unit_name_; }
+  const char* getFile() const { return test_unit_file_; }
+  std::size_t getLine() const { return test_unit_line_; }
+  unsigned getFlags() const { return test_unit_flags_; }
+  /// Wall-clock limit in milliseconds; 0 uses the default of the run.
+  unsigned getTimeout() const { return test_unit_timeout_; }
+
+protected:
+  /// Tag of the constructor that keeps pointers to the strings instead of
+  /// copying them, for the string literals of the test macros and the
+  /// descriptors of the cpput_tests section, which outlive the test.
+  enum StaticNames { staticNames };
+
+  Test(StaticNames, const char* className, const char* name, const char* file, std::size_t line,
+       unsigned flags = 0, unsigned timeout = 0);
+
+private:
+  virtual void do_run(Result& testResult_) = 0;
+
+  Test(const Test& other);
+  Test& operator=(const Test& rhs);
+
+private:
+  const char* test_unit_class_name_;
+  const char* test_unit_name_;
+  const char* test_unit_file_;
+  std::size_t test_unit_line_;
+  unsigned    test_unit_flags_;
+  unsigned    test_unit_timeout_;
+  Test*       test_unit_next_;
+  std::string test_unit_strings_;  ///< copies of the strings, null separated, unless static
+};
+
+// ----------------------------------------------------------------------------
+
+/// Constant description of a test. With CPPUT_SECTION_REGISTRATION defined
+/// the test macros emit one of these into the cpput_tests linker section
+/// instead of a global object, so registering a test costs no constructor
+/// call and no heap allocation at startup.
+struct TestDescriptor
+{
+  const char* className;
+  const char* name;
+  const char* file;
+  std::size_t line;
+  void (*run)(Result& testResult_);
+  unsigned flags;
+  unsigned timeout;
+};
+
+#if defined(__GNUC__) && defined(__ELF__)
+#define CPPUT_HAS_SECTION_REGISTRATION 1
+} // namespace cpput
+// Provided by the linker for every section with a C identifier name.
+extern "C" const ::cpput::TestDescriptor __start_cpput_tests[] __attribute__((weak));
+extern "C" const ::cpput::TestDescriptor __stop_cpput_tests[] __attribute__((weak));
+namespace cpput
+{
+#endif
+
+/// Adapts a section descriptor to the Test interface.
+class DescriptorTest : public Test
+{
+public:
+  explicit DescriptorTest(const TestDescriptor& descriptor)
+    : Test(staticNames, descriptor.className, descriptor.name, descriptor.file, descriptor.line,
+           descriptor.flags, descriptor.timeout)
+    , descriptor_(descriptor)
+  {
+  }
+
+private:
+  virtual void do_run(Result& testResult_) { descriptor_.run(testResult_); }
+
+private:
+  const TestDescriptor& descriptor_;
+};
+
+// ----------------------------------------------------------------------------
+
+/// Minimal wrappers around the platform threading primitives. Without
+/// thread support the mutex does nothing and tests always run sequentially.
+class Mutex
+{
+  friend class Condition;
+
+public:
+#ifdef CPPUT_HAS_THREADS
+  Mutex() { pthread_mutex_init(&mutex_, 0); }
+  ~Mutex() { pthread_mutex_destroy(&mutex_); }
+  void lock() { pthread_mutex_lock(&mutex_); }
+  void unlock() { pthread_mutex_unlock(&mutex_); }
+#else
+  void lock() {}
+  void unlock() {}
+#endif
+
+private:
+  Mutex(const Mutex& other);
+  Mutex& operator=(const Mutex& rhs);
+
+#ifdef CPPUT_HAS_THREADS
+  pthread_mutex_t mutex_;
+#endif
+};
+
+class Lock
+{
+public:
+  explicit Lock(Mutex& mutex) : mutex_(mutex) { mutex_.lock(); }
+  ~Lock() { mutex_.unlock(); }
+
+private:
+  Lock(const Lock& other);
+  Lock& operator=(const Lock& rhs);
+
+  Mutex& mutex_;
+};
+
+#ifdef CPPUT_HAS_THREADS
+
+// Clock of the deadlines passed to Condition::waitUntil().
+#ifdef __linux__
+#define CPPUT_WAIT_CLOCK CLOCK_MONOTONIC
+#else
+#define CPPUT_WAIT_CLOCK CLOCK_REALTIME
+#endif
+
+class Condition
+{
+public:
+  Condition()
+  {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+#ifdef __linux__
+    pthread_condattr_setclock(&attr, CPPUT_WAIT_CLOCK);
+#endif
+    pthread_cond_init(&cond_, &attr);
+    pthread_condattr_destroy(&attr);
+  }
+  ~Condition() { pthread_cond_destroy(&cond_); }
+  void wait(Mutex& mutex) { pthread_cond_wait(&cond_, &mutex.mutex_); }
+  void waitUntil(Mutex& mutex, const timespec& deadline) { pthread_cond_timedwait(&cond_, &mutex.mutex_, &deadline); }
+  void broadcast() { pthread_cond_broadcast(&cond_); }
+
+private:
+  Condition(const Condition& other);
+  Condition& operator=(const Condition& rhs);
+
+  pthread_cond_t cond_;
+};
+#endif
+
+// ----------------------------------------------------------------------------
+
+#ifdef CPPUT_HAS_THREADS
+struct WatchdogEntry
+{
+  const Test* test;
+  unsigned    timeout;
+  timespec    deadline;
+  pthread_t   thread;
+};
+#endif
+
+/// Enforces wall-clock timeouts of tests.
+///
+/// Test::run arms the watchdog with the test's own timeout or the default
+/// of the run. A background thread, started on first use, sleeps until the
+/// earliest deadline. When a test overruns, it prints which test hung and
+/// the stack of the hung thread, then aborts. Inside a worker process it
+/// exits the worker with timeoutExitStatus instead, so the runner can report
+/// the test and continue with a new worker.
+class Watchdog
+{
+public:
+  enum Action
+  {
+    Abort,
+    ExitProcess
+  };
+
+  static const int timeoutExitStatus = 124;
+
+  static Watchdog& instance()
+  {
+    // Never destroyed, the watchdog thread may still wait on it at exit.
+    static Watchdog* watchdog = new Watchdog;
+    return *watchdog;
+  }
+
+  void setDefaultTimeout(unsigned milliseconds) { defaultTimeout_ = milliseconds; }
+  unsigned getDefaultTimeout() const { return defaultTimeout_; }
+  void setAction(Action action) { action_ = action; }
+
+  /// Arms the watchdog for the calling thread while in scope.
+  class Guard
+  {
+  public:
+    explicit Guard(const Test& test);
+    ~Guard();
+
+  private:
+    Guard(const Guard& other);
+    Guard& operator=(const Guard& rhs);
+
+#ifdef CPPUT_HAS_THREADS
+    bool armed_;
+    std::list<WatchdogEntry>::iterator entry_;
+#endif
+  };
+
+private:
+  Watchdog()
+    : defaultTimeout_(0)
+    , action_(Abort)
+#ifdef CPPUT_HAS_THREADS
+    , running_(false)
+#endif
+  {
+  }
+  Watchdog(const Watchdog& other);
+  Watchdog& operator=(const Watchdog& rhs);
+
+#ifdef CPPUT_HAS_THREADS
+  typedef std::list<WatchdogEntry> Entries;
+
+  Entries::iterator arm(const Test& test, unsigned timeout);
+  void disarm(Entries::iterator entry);
+  void watch();
+  void expire(const WatchdogEntry& entry);
+
+  static void* threadMain(void*)
+  {
+    instance().watch();
+    return 0;
+  }
+
+  // Keeps the mutex consistent across fork() and drops the entries of the
+  // parent's threads, which do not exist in the child.
+  static void prepareFork() { instance().mutex_.lock(); }
+  static void parentAfterFork() { instance().mutex_.unlock(); }
+  static void childAfterFork();
+
+  static volatile sig_atomic_t& stackDumped()
+  {
+    static volatile sig_atomic_t dumped = 0;
+    return dumped;
+  }
+
+  static void dumpStack(int)
+  {
+#ifdef CPPUT_HAS_BACKTRACE
+    void* frames[64];
+    const int count = backtrace(frames, 64);
+    backtrace_symbols_fd(frames, count, STDERR_FILENO);
+#endif
+    stackDumped() = 1;
+  }
+#endif
+
+private:
+  unsigned  defaultTimeout_;
+  Action    action_;
+#ifdef CPPUT_HAS_THREADS
+  Mutex     mutex_;
+  Condition wakeup_;
+  Entries   armed_;
+  bool      running_;
+#endif
+};
+
+#ifdef CPPUT_HAS_THREADS
+
+inline Watchdog::Entries::iterator Watchdog::arm(const Test& test, unsigned timeout)
+{
+  WatchdogEntry entry;
+  entry.test = &test;
+  entry.timeout = timeout;
+  entry.thread = pthread_self();
+  clock_gettime(CPPUT_WAIT_CLOCK, &entry.deadline);
+  entry.deadline.tv_sec += timeout / 1000;
+  entry.deadline.tv_nsec += (timeout % 1000) * 1000000L;
+  if (entry.deadline.tv_nsec >= 1000000000L)
+  {
+    entry.deadline.tv_sec++;
+    entry.deadline.tv_nsec -= 1000000000L;
+  }
+
+  Lock lock(mutex_);
+  if (!running_)
+  {
+    static bool atforkRegistered = false;
+    if (!atforkRegistered)
+      pthread_atfork(&Watchdog::prepareFork, &Watchdog::parentAfterFork, &Watchdog::childAfterFork);
+    atforkRegistered = true;
+
+    pthread_t thread;
+    if (pthread_create(&thread, 0, &Watchdog::threadMain, 0) == 0)
+    {
+      pthread_detach(thread);
+      running_ = true;
+    }
+    else
+      std::cerr << "Cannot start the watchdog thread, test " << test.getClassName() << '.'
+                << test.getName() << " runs without a timeout.\n";
+  }
+  Entries::iterator it = armed_.insert(armed_.end(), entry);
+  wakeup_.broadcast();
+  return it;
+}
+
+inline void Watchdog::disarm(Entries::iterator entry)
+{
+  Lock lock(mutex_);
+  armed_.erase(entry);
+}
+
+inline void Watchdog::childAfterFork()
+{
+  // The primitives may still record waiters of the parent's watchdog
+  // thread, so the child starts over with fresh ones.
+  Watchdog& w = instance();
+  new (&w.mutex_) Mutex;
+  new (&w.wakeup_) Condition;
+  w.armed_.clear();
+  w.running_ = false;
+}
+
+inline void Watchdog::watch()
+{
+  Lock lock(mutex_);
+  for (;;)
+  {
+    if (armed_.empty())
+    {
+      wakeup_.wait(mutex_);
+      continue;
+    }
+
+    Entries::const_iterator first = armed_.begin();
+    for (Entries::const_iterator it = armed_.begin(); it != armed_.end(); ++it)
+      if (it->deadline.tv_sec < first->deadline.tv_sec ||
+          (it->deadline.tv_sec == first->deadline.tv_sec && it->deadline.tv_nsec < first->deadline.tv_nsec))
+        first = it;
+
+    timespec now;
+    clock_gettime(CPPUT_WAIT_CLOCK, &now);
+    if (now.tv_sec > first->deadline.tv_sec ||
+        (now.tv_sec == first->deadline.tv_sec && now.tv_nsec >= first->deadline.tv_nsec))
+      expire(*first);
+    // The entry may be erased while the wait has released the mutex.
+    const timespec deadline = first->deadline;
+    wakeup_.waitUntil(mutex_, deadline);
+  }
+}
+
+inline void Watchdog::expire(const WatchdogEntry& entry)
+{
+  std::cout.flush();
+  std::cerr << "\nTest " << entry.test->getClassName() << '.' << entry.test->getName()
+            << " (" << entry.test->getFile() << ", line " << entry.test->getLine()
+            << ") timed out after " << entry.timeout << " ms.\n";
+#ifdef CPPUT_HAS_BACKTRACE
+  std::cerr << "Stack of the hung test:\n";
+  std::cerr.flush();
+  struct sigaction action;
+  std::memset(&action, 0, sizeof(action));
+  action.sa_handler = &Watchdog::dumpStack;
+  sigaction(SIGUSR2, &action, 0);
+  stackDumped() = 0;
+  pthread_kill(entry.thread, SIGUSR2);
+  for (int i = 0; i < 100 && !stackDumped(); ++i)
+    usleep(10000);
+#endif
+  std::cerr.flush();
+  if (action_ == ExitProcess)
+    _exit(timeoutExitStatus);
+  std::abort();
+}
+
+inline Watchdog::Guard::Guard(const Test& test)
+  : armed_(false)
+{
+  const unsigned timeout = test.getTimeout() ? test.getTimeout() : instance().getDefaultTimeout();
+  if (timeout == 0)
+    return;
+  entry_ = instance().arm(test, timeout);
+  armed_ = true;
+}
+
+inline Watchdog::Guard::~Guard()
+{
+  if (armed_)
+    instance().disarm(entry_);
+}
+
+#else
+
+inline Watchdog::Guard::Guard(const Test&) {}
+inline Watchdog::Guard::~Guard() {}
+
+#endif // CPPUT_HAS_THREADS
+
+// ----------------------------------------------------------------------------
+
+inline void Test::run(ResultWriter& out)
+{
+  Watchdog::Guard watchdog(*this);
+  Result result(test_unit_class_name_, test_unit_name_, out);
+  try
+  {
+    do_run(result);
+  }
+  catch (const std::exception& e)
+  {
+    result.addFailure(__FILE__, __LINE__, std::string("Unexpected exception: ").append(e.what()).c_str());
+  }
+  catch (...)
+  {
+    result.addFailure(__FILE__, __LINE__, "Unspecified exception!");
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+/// Registry of all tests in the binary.
+///
+/// Tests are appended in constant time during static initialization. The
+/// lookup index by group and name is built lazily on first use and only
+/// covers tests added since the previous lookup, so registration never pays
+/// for it.
+class Repository
+{
+public:
+  typedef std::vector<Test*> TestList;
+
+  static Repository& instance()
+  {
+    static Repository repo;
+    return repo;
+  }
+  
+  void add(Test* tc)
+  {
+    if (!tests_)
+      tests_ = tc;
+    else
+      last_->test_unit_next_ = tc;
+    last_ = tc;
+    size_++;
+  }
+  
+  Test* getTests() { loadSection(); return tests_; }
+  std::size_t size() { loadSection(); return size_; }
+
+  /// Returns the test registered as group.name or 0 if there is none.
+  Test* find(const std::string& group, const std::string& name)
+  {
+    Lock lock(indexMutex_);
+    updateIndex();
+    NameIndex::const_iterator it = byName_.find(std::make_pair(group, name));
+    return it == byName_.end() ? 0 : it->second;
+  }
+
+  /// Returns all tests of a group in registration order.
+  const TestList& findGroup(const std::string& group)
+  {
+    static const TestList empty;
+    Lock lock(indexMutex_);
+    updateIndex();
+    GroupIndex::const_iterator it = byGroup_.find(group);
+    return it == byGroup_.end() ? empty : it->second;
+  }
+
+private:
+  typedef std::map<std::pair<std::string, std::string>, Test*> NameIndex;
+  typedef std::map<std::string, TestList> GroupIndex;
+
+  Repository() : tests_(0), last_(0), size_(0), indexed_(0), sectionLoaded_(false) {}
+  Repository(const Repository& other);
+  Repository& operator=(const Repository& rhs) const;
+
+  /// Appends the tests of the cpput_tests section after the ones registered
+  /// by constructors. The adapters share a single allocation and, like the
+  /// static test objects, live until the program exits.
+  void loadSection()
+  {
+    if (sectionLoaded_)
+      return;
+    sectionLoaded_ = true;
+#ifdef CPPUT_HAS_SECTION_REGISTRATION
+    const TestDescriptor* begin = __start_cpput_tests;
+    const TestDescriptor* end = __stop_cpput_tests;
+    if (!begin || begin == end)
+      return;
+    const std::size_t count = end - begin;
+    DescriptorTest* tests = static_cast<DescriptorTest*>(::operator new(count * sizeof(DescriptorTest)));
+    for (std::size_t i = 0; i < count; ++i)
+      new (tests + i) DescriptorTest(begin[i]);
+#endif
+  }
+
+  void updateIndex()
+  {
+    loadSection();
+    Test* t = indexed_ ? indexed_->test_unit_next_ : tests_;
+    for (; t; t = t->test_unit_next_)
+    {
+      byName_.insert(std::make_pair(std::make_pair(t->test_unit_class_name_, t->test_unit_name_), t));
+      byGroup_[t->test_unit_class_name_].push_back(t);
+      indexed_ = t;
+    }
+  }
+
+private:
+  Test*       tests_;
+  Test*       last_;
+  std::size_t size_;
+  Test*       indexed_;
+  NameIndex   byName_;
+  GroupIndex  byGroup_;
+  Mutex       indexMutex_;
+  bool        sectionLoaded_;
+};
+
+inline Test::Test(const char* className, const char* name, const char* file, std::size_t line,
+                  unsigned flags, unsigned timeout)
+  : test_unit_line_(line)
+  , test_unit_flags_(flags)
+  , test_unit_timeout_(timeout)
+  , test_unit_next_(0)
+{
+  // One string holds all three copies, so a test costs one allocation at most.
+  test_unit_strings_.append(className).append(1, '\0').append(name).append(1, '\0').append(file);
+  test_unit_class_name_ = test_unit_strings_.c_str();
+  test_unit_name_ = test_unit_class_name_ + std::strlen(className) + 1;
+  test_unit_file_ = test_unit_name_ + std::strlen(name) + 1;
+  Repository::instance().add(this);
+}
+
+inline Test::Test(StaticNames, const char* className, const char* name, const char* file, std::size_t line,
+                  unsigned flags, unsigned timeout)
+  : test_unit_class_name_(className)
+  , test_unit_name_(name)
+  , test_unit_file_(file)
+  , test_unit_line_(line)
+  , test_unit_flags_(flags)
+  , test_unit_timeout_(timeout)
+  , test_unit_next_(0)
+{
+  Repository::instance().add(this);
+}
+
+// ----------------------------------------------------------------------------
+// Benchmarks
+// ----------------------------------------------------------------------------
+
+/// Clock of the benchmarks, read through now() in ticks.
+///
+/// On x86-64 Linux with an invariant time stamp counter the ticks are TSC
+/// cycles read with rdtscp, calibrated against CLOCK_MONOTONIC on first
+/// use; elsewhere they are nanoseconds of clock_gettime. The cost of one
+/// now() call is measured as well, so that it can be subtracted from
+/// measurements.
+class BenchmarkClock
+{
+public:
+  static BenchmarkClock& instance()
+  {
+    static BenchmarkClock clock;
+    return clock;
+  }
+
+  uint64_t now() const
+  {
+#ifdef CPPUT_HAS_TSC
+    if (tsc_)
+    {
+      // rdtscp waits for earlier instructions, lfence keeps later ones from
+      // starting before the counter is read.
+      unsigned low, high, aux;
+      __asm__ __volatile__("rdtscp\n\tlfence" : "=a"(low), "=d"(high), "=c"(aux) : : "memory");
+      return (static_cast<uint64_t>(high) << 32) | low;
+    }
+#endif
+    return monotonicNanoseconds();
+  }
+
+  double toSeconds(uint64_t ticks) const { return ticks * secondsPerTick_; }
+
+  /// Ticks between start and end without the cost of reading the clock.
+  uint64_t elapsed(uint64_t start, uint64_t end) const
+  {
+    const uint64_t ticks = end - start;
+    return ticks > overhead_ ? ticks - overhead_ : 0;
+  }
+
+  /// Ticks taken by one call to now().
+  uint64_t overhead() const { return overhead_; }
+
+  /// "tsc" or "clock_gettime".
+  const char* name() const { return tsc_ ? "tsc" : "clock_gettime"; }
+
+  /// True when the CPU has rdtscp and an invariant TSC, and CPPUT_NO_TSC is
+  /// not set in the environment.
+  static bool tscAvailable()
+  {
+#ifdef CPPUT_HAS_TSC
+    unsigned eax, ebx, ecx, edx;
+    const bool rdtscp = __get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) && (edx & (1u << 27));
+    const bool invariant = __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1u << 8));
+    return rdtscp && invariant && !std::getenv("CPPUT_NO_TSC");
+#else
+    return false;
+#endif
+  }
+
+private:
+  BenchmarkClock()
+    : tsc_(false)
+    , secondsPerTick_(1e-9)
+    , overhead_(0)
+  {
+#ifdef CPPUT_HAS_TSC
+    if (tscAvailable())
+    {
+      tsc_ = true;
+      const uint64_t startTime = monotonicNanoseconds();
+      const uint64_t startTicks = now();
+      uint64_t endTime = startTime;
+      while (endTime - startTime < 10000000)
+        endTime = monotonicNanoseconds();
+      const uint64_t endTicks = now();
+      secondsPerTick_ = (endTime - startTime) * 1e-9 / (endTicks - startTicks);
+    }
+#endif
+    uint64_t best = ~static_cast<uint64_t>(0);
+    for (int i = 0; i < 1000; ++i)
+    {
+      const uint64_t first = now();
+      const uint64_t second = now();
+      best = std::min(best, second - first);
+    }
+    overhead_ = best;
+  }
+
+  static uint64_t monotonicNanoseconds()
+  {
+#ifdef CPPUT_HAS_THREADS
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#else
+    return static_cast<uint64_t>(static_cast<double>(std::clock()) / CLOCKS_PER_SEC * 1e9);
+#endif
+  }
+
+  BenchmarkClock(const BenchmarkClock& other);
+  BenchmarkClock& operator=(const BenchmarkClock& rhs);
+
+private:
+  bool     tsc_;
+  double   secondsPerTick_;
+  uint64_t overhead_;
+};
+
+/// Keeps the compiler from optimizing away the computation of value.
+template <typename T>
+inline void doNotOptimize(const T& value)
+{
+#if defined(__GNUC__)
+  __asm__ __volatile__("" : : "r,m"(value) : "memory");
+#else
+  static const volatile void* sink;
+  sink = &value;
+#endif
+}
+
+/// Forces all pending writes to memory to be treated as observable.
+inline void clobberMemory()
+{
+#if defined(__GNUC__)
+  __asm__ __volatile__("" : : : "memory");
+#endif
+}
+
+/// Heap allocations counted by the replacement of the global operator new
+/// that is compiled into the one translation unit that defines
+/// CPPUT_COUNT_ALLOCATIONS before including this header. Counts are kept
+/// per thread where the compiler supports thread local storage.
+class AllocationCounter
+{
+public:
+  struct Counts
+  {
+    uint64_t allocations;
+    uint64_t bytes;
+  };
+
+  /// True if the replacement operator new is linked into the program.
+  static bool& installed()
+  {
+    static bool installed = false;
+    return installed;
+  }
+
+  /// Counts of the calling thread since it started.
+  static Counts& counts()
+  {
+    static CPPUT_THREAD_LOCAL Counts counts;
+    return counts;
+  }
+
+  static void count(std::size_t bytes)
+  {
+    Counts& c = counts();
+    c.allocations++;
+    c.bytes += bytes;
+  }
+};
+
+/// False if the system has transparent huge pages disabled.
+inline bool transparentHugePagesEnabled()
+{
+  std::ifstream in("/sys/kernel/mm/transparent_hugepage/enabled");
+  std::string line;
+  return !std::getline(in, line) || line.find("[never]") == std::string::npos;
+}
+
+/// Size in bytes of the last level cache, or 32 MB if it is unknown.
+inline std::size_t lastLevelCacheSize()
+{
+#if defined(_SC_LEVEL3_CACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE)
+  long size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+  if (size <= 0)
+    size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  if (size > 0)
+    return static_cast<std::size_t>(size);
+#endif
+  return 32 << 20;
+}
+
+/// Evicts all data caches by writing every cache line of buffer, which
+/// should be twice the size of the last level cache. Threads evicting at
+/// the same time each need a buffer of their own.
+inline void evictCaches(std::vector<char>& buffer)
+{
+  for (std::size_t i = 0; i < buffer.size(); i += 64)
+    buffer[i]++;
+  clobberMemory();
+}
+
+/// Flushes the cache lines holding bytes at data from all caches. Returns
+/// false where the CPU has no cache line flush instruction.
+inline bool flushCacheLines(const void* data, std::size_t bytes)
+{
+#if defined(__GNUC__) && defined(__SSE2__)
+  const char* p = static_cast<const char*>(data);
+  for (std::size_t i = 0; i < bytes; i += 64)
+    __builtin_ia32_clflush(p + i);
+  if (bytes > 0)
+    __builtin_ia32_clflush(p + bytes - 1);
+  __builtin_ia32_mfence();
+  return true;
+#else
+  (void)data;
+  (void)bytes;
+  return false;
+#endif
+}
+
+/// Benchmark results saved to and loaded from a file, used as the reference
+/// of a regression gate. The file starts with a version line followed by
+/// one line per benchmark: "<group>.<name> <median> <stddev>" with times
+/// per iteration in seconds.
+class BenchmarkBaseline
+{
+public:
+  struct Entry
+  {
+    Entry() : median(0), stddev(0) {}
+
+    double median;
+    double stddev;
+  };
+
+  static const int version = 1;
+
+  bool load(const std::string& path)
+  {
+    std::ifstream in(path.c_str());
+    std::string magic;
+    int fileVersion = 0;
+    if (!(in >> magic >> fileVersion) || magic != "cpput-baseline" || fileVersion != version)
+      return false;
+    std::string name;
+    Entry entry;
+    while (in >> name >> entry.median >> entry.stddev)
+      entries_[name] = entry;
+    return in.eof();
+  }
+
+  bool save(const std::string& path) const
+  {
+    std::ofstream out(path.c_str());
+    out << "cpput-baseline " << version << "\n" << std::setprecision(9);
+    for (std::map<std::string, Entry>::const_iterator i = entries_.begin(); i != entries_.end(); ++i)
+      out << i->first << ' ' << i->second.median << ' ' << i->second.stddev << "\n";
+    return static_cast<bool>(out);
+  }
+
+  void add(const BenchmarkResult& result)
+  {
+    Entry& entry = entries_[result.className + "." + result.name];
+    entry.median = result.time.median;
+    entry.stddev = result.time.stddev;
+  }
+
+  const Entry* find(const std::string& fullName) const
+  {
+    std::map<std::string, Entry>::const_iterator i = entries_.find(fullName);
+    return i == entries_.end() ? 0 : &i->second;
+  }
+
+  std::size_t size() const { return entries_.size(); }
+
+  /// Returns a description of the regression if the median of result is
+  /// slower than the baseline by more than threshold (a fraction) plus twice
+  /// the combined standard deviation of both measurements, else an empty
+  /// string. Benchmarks missing from the baseline never regress.
+  std::string check(const BenchmarkResult& result, double threshold) const
+  {
+    const Entry* entry = find(result.className + "." + result.name);
+    if (!entry || entry->median <= 0)
+      return std::string();
+    const double noise = 2 * std::sqrt(entry->stddev * entry->stddev + result.time.stddev * result.time.stddev);
+    const double allowed = entry->median * (1 + threshold) + noise;
+    if (result.time.median <= allowed)
+      return std::string();
+    std::ostringstream message;
+    message << "Regressed by " << std::setprecision(3) << (result.time.median / entry->median - 1) * 100
+            << "% against the baseline, median " << formatDuration(entry->median)
+            << " -> " << formatDuration(result.time.median)
+            << ", allowed " << formatDuration(allowed);
+    return message.str();
+  }
+
+private:
+  std::map<std::string, Entry> entries_;
+};
+
+/// Settings of the benchmark measurements in a run.
+struct BenchmarkSettings
+{
+  BenchmarkSettings()
+    : minTime(0.1)
+    , repetitions(5)
+    , regressionThreshold(0.1)
+    , warmupThreshold(0.05)
+    , maxWarmupTime(1)
+    , noiseThreshold(0.1)
+    , coldCache(false)
+    , compareTo(0)
+    , record(0)
+  {
+  }
+
+  double      minTime;      ///< minimum seconds measured per repetition
+  std::size_t repetitions;
+  /// Slowdown against the baseline tolerated beyond the noise, as a fraction.
+  double      regressionThreshold;
+  /// Warm up until the coefficient of variation of the time per iteration
+  /// of the last warmup batches is below this fraction; 0 disables warmup.
+  double      warmupThreshold;
+  /// Seconds after which warmup stops even if the timing is not steady.
+  double      maxWarmupTime;
+  /// Share of the CPU time of the CPUs the benchmarks may run on that other
+  /// processes may use before a result is marked unreliable.
+  double      noiseThreshold;
+  /// Measure every benchmark with cold caches too.
+  bool        coldCache;
+  /// Baseline that results are checked against, if any.
+  const BenchmarkBaseline* compareTo;
+  /// Baseline that results are added to, if any.
+  BenchmarkBaseline* record;
+};
+
+/// Iteration state passed to a benchmark body, which loops while
+/// keepRunning() returns true. The timer runs from the first call to the
+/// call that ends the loop.
+class BenchmarkState
+{
+public:
+  explicit BenchmarkState(std::size_t iterations, std::size_t range = 0,
+                          std::size_t threadIndex = 0, std::size_t threads = 1,
+                          LatencyHistogram* histogram = 0)
+    : remaining_(0)
+    , iterations_(iterations)
+    , range_(range)
+    , threadIndex_(threadIndex)
+    , threads_(threads)
+    , histogram_(histogram)
+    , pending_(0)
+    , expectedInterval_(0)
+    , batch_(1)
+    , evictionBuffer_(0)
+    , perTurn_(false)
+    , started_(false)
+    , finished_(false)
+    , paused_(false)
+    , clock_(BenchmarkClock::instance())
+    , start_(0)
+    , last_(0)
+    , pausedAt_(0)
+    , pausedTicks_(0)
+    , timed_(0)
+    , elapsed_(0)
+    , bytesProcessed_(0)
+    , itemsProcessed_(0)
+    , allocations_(0)
+    , allocatedBytes_(0)
+    , pausedAllocations_(0)
+    , pausedBytes_(0)
+    , allocator_(DefaultAllocator)
+    , arena_(0)
+    , arenaMark_(0)
+  {
+  }
+
+  ~BenchmarkState()
+  {
+    // A failed assertion leaves the loop without finishing it.
+    if (arena_ && !finished_)
+    {
+      if (BenchmarkArena::current() == arena_)
+        BenchmarkArena::current() = 0;
+      arena_->reset(arenaMark_);
+    }
+  }
+
+  bool keepRunning()
+  {
+    if (remaining_ != 0)
+    {
+      --remaining_;
+      return true;
+    }
+    return nextPhase();
+  }
+
+  /// Like keepRunning() for a body that performs batch iterations per turn
+  /// of the loop, which amortizes the loop overhead for very short
+  /// operations. The iteration count is rounded up to a multiple of batch.
+  bool keepRunningBatch(std::size_t batch)
+  {
+    if (remaining_ >= batch)
+    {
+      remaining_ -= batch;
+      return true;
+    }
+    if (!started_)
+    {
+      batch_ = std::max<std::size_t>(batch, 1);
+      iterations_ = (iterations_ + batch_ - 1) / batch_ * batch_;
+    }
+    return nextPhase();
+  }
+
+  /// Iterations the body runs, a multiple of the batch of keepRunningBatch().
+  std::size_t iterations() const { return iterations_; }
+  /// Input size of a range benchmark.
+  std::size_t range() const { return range_; }
+  /// Index of the calling thread in a threaded benchmark, 0 .. threads() - 1.
+  std::size_t threadIndex() const { return threadIndex_; }
+  std::size_t threads() const { return threads_; }
+  bool finished() const { return finished_; }
+
+  /// Stops the timer inside the loop, e.g. to prepare the input of the next
+  /// iteration. Neither the time until resumeTiming() nor its allocations
+  /// are measured; the cost of the pair itself, one clock read, is
+  /// subtracted as well.
+  void pauseTiming()
+  {
+    if (paused_ || !started_ || finished_)
+      return;
+    paused_ = true;
+    // Modulo arithmetic: the counts at the pause are added back on resume.
+    pausedAllocations_ -= AllocationCounter::counts().allocations;
+    pausedBytes_ -= AllocationCounter::counts().bytes;
+    pausedAt_ = clock_.now();
+  }
+
+  void resumeTiming()
+  {
+    if (paused_)
+      resumeAt(clock_.now());
+  }
+  /// True if setExpectedInterval() was called.
+  bool corrected() const { return expectedInterval_ != 0; }
+
+  /// Registers memory the body works on. In a cold run these bytes are
+  /// flushed from the caches before every iteration; without registered
+  /// regions all caches are evicted instead, which is much slower.
+  void addColdRegion(const void* data, std::size_t bytes)
+  {
+    regions_.push_back(std::make_pair(data, bytes));
+  }
+
+  /// Declares the bytes the whole loop processed, usually
+  /// state.iterations() times the bytes of one iteration, to report the
+  /// throughput in bytes per second.
+  void setBytesProcessed(double bytes) { bytesProcessed_ = bytes; }
+  double bytesProcessed() const { return bytesProcessed_; }
+  /// Declares the items, e.g. messages or records, the whole loop processed.
+  void setItemsProcessed(double items) { itemsProcessed_ = items; }
+  double itemsProcessed() const { return itemsProcessed_; }
+
+  /// Heap allocations the loop made on the calling thread, and their bytes.
+  /// Only counted if the program was built with CPPUT_COUNT_ALLOCATIONS.
+  uint64_t allocations() const { return allocations_; }
+  uint64_t allocatedBytes() const { return allocatedBytes_; }
+
+  /// Allocator of the loop, set by the runner for BENCHMARK_ALLOCATORS.
+  void setAllocator(Allocator allocator) { allocator_ = allocator; }
+
+  /// Evict caches through evictionBuffer before every iteration and time
+  /// only the iterations; null for a warm run. Set by the runner for cold
+  /// runs.
+  void setColdCache(std::vector<char>* evictionBuffer) { evictionBuffer_ = evictionBuffer; }
+
+  /// Declares that the loop issues one iteration every seconds, so that
+  /// latency benchmarks correct for coordinated omission. Call it before
+  /// the loop.
+  void setExpectedInterval(double seconds)
+  {
+    expectedInterval_ = static_cast<uint64_t>(seconds * 1e9);
+  }
+  double elapsed() const { return elapsed_; }
+
+private:
+  bool nextPhase()
+  {
+    if (!started_ && iterations_ > 0)
+    {
+      started_ = true;
+      // Latency, cold and allocator runs come back here after every turn
+      // of the loop.
+      perTurn_ = histogram_ || evictionBuffer_ || allocator_ != DefaultAllocator;
+      if (perTurn_)
+        pending_ = iterations_ / batch_ - 1;
+      else
+        remaining_ = iterations_ - batch_;
+      if (evictionBuffer_)
+        evict();
+      allocations_ = AllocationCounter::counts().allocations;
+      allocatedBytes_ = AllocationCounter::counts().bytes;
+      if (allocator_ == ArenaAllocator || allocator_ == HugePageAllocator)
+      {
+        arena_ = &BenchmarkArena::instance(allocator_ == HugePageAllocator);
+        arenaMark_ = arena_->mark();
+        BenchmarkArena::current() = arena_;
+      }
+      start_ = last_ = clock_.now();
+      return true;
+    }
+    const uint64_t now = clock_.now();
+    if (paused_)
+      resumeAt(now);
+    if (perTurn_ && !finished_)
+    {
+      const uint64_t ticks = unpaused(clock_.elapsed(last_, now));
+      timed_ += ticks;
+      if (histogram_)
+      {
+        const uint64_t nanoseconds = static_cast<uint64_t>(clock_.toSeconds(ticks) * 1e9);
+        for (std::size_t i = 0; i < batch_; ++i)
+          histogram_->recordCorrected(nanoseconds / batch_, expectedInterval_);
+      }
+      if (pending_ != 0)
+      {
+        --pending_;
+        if (evictionBuffer_)
+          evict();
+        if (arena_)
+          arena_->reset(arenaMark_);
+        last_ = clock_.now();
+        return true;
+      }
+      finish(clock_.toSeconds(timed_));
+      return false;
+    }
+    if (!finished_)
+      finish(clock_.toSeconds(unpaused(clock_.elapsed(start_, now))));
+    return false;
+  }
+
+  void resumeAt(uint64_t now)
+  {
+    paused_ = false;
+    pausedTicks_ += now - pausedAt_ + clock_.overhead();
+    pausedAllocations_ += AllocationCounter::counts().allocations;
+    pausedBytes_ += AllocationCounter::counts().bytes;
+  }
+
+  /// Removes the ticks paused since the last call from ticks.
+  uint64_t unpaused(uint64_t ticks)
+  {
+    ticks = ticks > pausedTicks_ ? ticks - pausedTicks_ : 0;
+    pausedTicks_ = 0;
+    return ticks;
+  }
+
+  void finish(double elapsed)
+  {
+    elapsed_ = elapsed;
+    finished_ = true;
+    if (arena_)
+    {
+      BenchmarkArena::current() = 0;
+      arena_->reset(arenaMark_);
+    }
+    allocations_ = AllocationCounter::counts().allocations - allocations_ - pausedAllocations_;
+    allocatedBytes_ = AllocationCounter::counts().bytes - allocatedBytes_ - pausedBytes_;
+  }
+
+  void evict()
+  {
+    bool flushed = !regions_.empty();
+    for (std::size_t i = 0; i < regions_.size() && flushed; ++i)
+      flushed = flushCacheLines(regions_[i].first, regions_[i].second);
+    if (!flushed)
+      evictCaches(*evictionBuffer_);
+  }
+
+  BenchmarkState(const BenchmarkState& other);
+  BenchmarkState& operator=(const BenchmarkState& rhs);
+
+private:
+  std::size_t remaining_;
+  std::size_t iterations_;
+  std::size_t range_;
+  std::size_t threadIndex_;
+  std::size_t threads_;
+  LatencyHistogram* histogram_;
+  std::size_t pending_;
+  uint64_t    expectedInterval_;
+  std::size_t batch_;
+  std::vector<char>* evictionBuffer_;
+  bool        perTurn_;
+  bool        started_;
+  bool        finished_;
+  bool        paused_;
+  const BenchmarkClock& clock_;
+  uint64_t    start_;
+  uint64_t    last_;
+  uint64_t    pausedAt_;
+  uint64_t    pausedTicks_;     ///< paused since the last turn of the loop
+  uint64_t    timed_;
+  double      elapsed_;
+  double      bytesProcessed_;
+  double      itemsProcessed_;
+  uint64_t    allocations_;     ///< counts at the start, then made by the loop
+  uint64_t    allocatedBytes_;
+  uint64_t    pausedAllocations_;
+  uint64_t    pausedBytes_;
+  Allocator   allocator_;
+  BenchmarkArena* arena_;
+  char*       arenaMark_;
+  std::vector<std::pair<const void*, std::size_t> > regions_;
+};
+
+/// Base of the fixtures of BENCHMARK_F. A fixture is constructed for every
+/// run of the body, on every thread of a threaded benchmark, and setUp() and
+/// tearDown() run before and after its loop, outside the measured time.
+class BenchmarkFixture
+{
+public:
+  virtual ~BenchmarkFixture() {}
+
+  virtual void setUp(BenchmarkState&) {}
+  virtual void tearDown(BenchmarkState&) {}
+};
+
+/// Number of online CPUs.
+inline std::size_t onlineCpus()
+{
+#ifdef CPPUT_HAS_THREADS
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return cpus > 0 ? static_cast<std::size_t>(cpus) : 1;
+#else
+  return 1;
+#endif
+}
+
+/// CPUs the calling thread may run on, in ascending order.
+inline std::vector<int> allowedCpus()
+{
+  std::vector<int> cpus;
+#ifdef CPPUT_HAS_AFFINITY
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+      if (CPU_ISSET(cpu, &set))
+        cpus.push_back(cpu);
+#endif
+  if (cpus.empty())
+    for (std::size_t cpu = 0; cpu < onlineCpus(); ++cpu)
+      cpus.push_back(static_cast<int>(cpu));
+  return cpus;
+}
+
+/// Parses a CPU list such as "0-3,6" into ascending CPU numbers. Returns
+/// false if the list is empty or malformed.
+inline bool parseCpuList(const std::string& list, std::vector<int>& cpus)
+{
+  cpus.clear();
+  std::istringstream in(list);
+  std::string item;
+  while (std::getline(in, item, ','))
+  {
+    char* end = 0;
+    const long first = std::strtol(item.c_str(), &end, 10);
+    long last = first;
+    if (end == item.c_str() || first < 0)
+      return false;
+    if (*end == '-')
+    {
+      const char* from = end + 1;
+      last = std::strtol(from, &end, 10);
+      if (end == from || last < first)
+        return false;
+    }
+    if (*end != '\0')
+      return false;
+    for (long cpu = first; cpu <= last; ++cpu)
+      cpus.push_back(static_cast<int>(cpu));
+  }
+  std::sort(cpus.begin(), cpus.end());
+  cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+  return !cpus.empty();
+}
+
+/// Restricts the calling thread, and the threads it creates afterwards, to
+/// the given CPUs. Returns false if that is not possible.
+inline bool pinToCpus(const std::vector<int>& cpus)
+{
+#ifdef CPPUT_HAS_AFFINITY
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (std::size_t i = 0; i < cpus.size(); ++i)
+  {
+    if (cpus[i] >= CPU_SETSIZE)
+      return false;
+    CPU_SET(cpus[i], &set);
+  }
+  return !cpus.empty() && sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+  return cpus.empty();
+#endif
+}
+
+/// Describes the CPU settings that make benchmark timings vary with the
+/// temperature and the load of the machine: a frequency governor other than
+/// "performance" on any of the CPUs, and turbo boost. Returns one message
+/// per problem; none where the settings cannot be read.
+inline std::vector<std::string> frequencyWarnings(const std::vector<int>& cpus)
+{
+  std::vector<std::string> warnings;
+  std::string value;
+  for (std::size_t i = 0; i < cpus.size(); ++i)
+  {
+    std::ostringstream path;
+    path << "/sys/devices/system/cpu/cpu" << cpus[i] << "/cpufreq/scaling_governor";
+    std::ifstream in(path.str().c_str());
+    if (in >> value && value != "performance")
+    {
+      std::ostringstream warning;
+      warning << "CPU " << cpus[i] << " uses the \"" << value
+              << "\" frequency governor instead of \"performance\"";
+      warnings.push_back(warning.str());
+      break;
+    }
+  }
+  std::ifstream noTurbo("/sys/devices/system/cpu/intel_pstate/no_turbo");
+  std::ifstream boost("/sys/devices/system/cpu/cpufreq/boost");
+  if ((noTurbo >> value && value == "0") || (boost >> value && value == "1"))
+    warnings.push_back("turbo boost is enabled");
+  return warnings;
+}
+
+/// Measures the CPU time other processes use on a set of CPUs between
+/// start() and otherLoad(), from the busy time in /proc/stat minus the CPU
+/// time of this process. Reports no load where /proc/stat does not exist.
+class SystemLoad
+{
+public:
+  explicit SystemLoad(const std::vector<int>& cpus)
+    : cpus_(cpus)
+    , busy_(0)
+    , self_(0)
+    , start_(0)
+  {
+  }
+
+  void start()
+  {
+    busy_ = busyTicks();
+    self_ = selfSeconds();
+    start_ = BenchmarkClock::instance().now();
+  }
+
+  /// Share of the time of the CPUs used by other processes since start(),
+  /// from 0 to 1. Two clock ticks per CPU are ignored, as /proc/stat only
+  /// counts whole ticks.
+  double otherLoad() const
+  {
+    const BenchmarkClock& clock = BenchmarkClock::instance();
+    const double wall = clock.toSeconds(clock.now() - start_);
+    const double hz = static_cast<double>(ticksPerSecond());
+    if (wall <= 0 || hz <= 0 || cpus_.empty())
+      return 0;
+    const double other = static_cast<double>(busyTicks() - busy_) - (selfSeconds() - self_) * hz
+                         - 2.0 * cpus_.size();
+    return std::min(1.0, std::max(0.0, other / hz / (wall * cpus_.size())));
+  }
+
+private:
+  static long ticksPerSecond()
+  {
+#ifdef CPPUT_HAS_THREADS
+    return sysconf(_SC_CLK_TCK);
+#else
+    return 0;
+#endif
+  }
+
+  /// Ticks the CPUs spent neither idle nor waiting for I/O.
+  uint64_t busyTicks() const
+  {
+    std::ifstream in("/proc/stat");
+    std::string line;
+    uint64_t busy = 0;
+    while (std::getline(in, line) && line.compare(0, 3, "cpu") == 0)
+    {
+      std::istringstream fields(line.substr(3));
+      int cpu = -1;
+      if (!(fields >> cpu) || !std::binary_search(cpus_.begin(), cpus_.end(), cpu))
+        continue;
+      uint64_t ticks = 0;
+      for (int field = 0; fields >> ticks; ++field)
+        if (field != 3 && field != 4 && field < 8)  // idle, iowait; guests are in user
+          busy += ticks;
+    }
+    return busy;
+  }
+
+  static double selfSeconds()
+  {
+#ifdef CPPUT_HAS_THREADS
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+      return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+             + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+#endif
+    return 0;
+  }
+
+  std::vector<int> cpus_;
+  uint64_t         busy_;
+  double           self_;
+  uint64_t         start_;
+};
+
+#ifdef CPPUT_HAS_THREADS
+
+/// Blocks threads until all of them have arrived, so they start together.
+class Barrier
+{
+public:
+  explicit Barrier(std::size_t count)
+    : count_(count)
+    , waiting_(0)
+    , generation_(0)
+  {
+  }
+
+  void wait()
+  {
+    Lock lock(mutex_);
+    const std::size_t generation = generation_;
+    if (++waiting_ == count_)
+    {
+      waiting_ = 0;
+      generation_++;
+      released_.broadcast();
+      return;
+    }
+    while (generation == generation_)
+      released_.wait(mutex_);
+  }
+
+  /// Removes a thread that will never arrive, releasing the others if they
+  /// were only waiting for it.
+  void leave()
+  {
+    Lock lock(mutex_);
+    if (--count_ == waiting_ && waiting_ > 0)
+    {
+      waiting_ = 0;
+      generation_++;
+      released_.broadcast();
+    }
+  }
+
+private:
+  Barrier(const Barrier& other);
+  Barrier& operator=(const Barrier& rhs);
+
+  Mutex       mutex_;
+  Condition   released_;
+  std::size_t count_;
+  std::size_t waiting_;
+  std::size_t generation_;
+};
+
+#endif
+
+/// A test that measures the time of its body.
+///
+/// The iteration count is grown until one run of the body takes at least
+/// the minimum time of the settings; that count is then used for all
+/// repetitions. The statistics are reported per iteration through
+/// ResultWriter::benchmark().
+class Benchmark : public Test
+{
+public:
+  Benchmark(const char* className, const char* name, const char* file, std::size_t line,
+            std::size_t range = 0, std::size_t threads = 1)
+    : Test(className, name, file, line, IsBenchmark)
+    , latency_(false)
+    , cold_(false)
+    , allocator_(DefaultAllocator)
+    , threaded_(threads > 1)
+    , range_(range)
+    , threads_(threads)
+    , corrected_(false)
+    , unpinnedWarned_(false)
+    , coldRun_(false)
+    , bytes_(0)
+    , items_(0)
+    , allocations_(0)
+    , allocatedBytes_(0)
+  {
+  }
+
+  /// Settings used by all benchmarks, set by runAllTests().
+  static BenchmarkSettings& settings()
+  {
+    static BenchmarkSettings s;
+    return s;
+  }
+
+  /// Runs the body once for the given number of iterations and returns the
+  /// measured seconds, or a negative value if the run failed. A threaded
+  /// benchmark runs the iterations on each of its threads and measures the
+  /// slowest thread. If histogram is given, the latency of every iteration
+  /// is recorded into it.
+  double runOnce(Result& testResult_, std::size_t iterations, LatencyHistogram* histogram = 0)
+  {
+#ifdef CPPUT_HAS_THREADS
+    if (threaded_)
+      return runThreads(testResult_, iterations, histogram);
+#endif
+    BenchmarkState state(iterations, range_, 0, 1, histogram);
+    state.setColdCache(coldRun_ ? &evictionBuffers_[0] : 0);
+    state.setAllocator(allocator_);
+    do_benchmark(testResult_, state);
+    corrected_ = corrected_ || state.corrected();
+    bytes_ = state.bytesProcessed() / state.iterations();
+    items_ = state.itemsProcessed() / state.iterations();
+    allocations_ = static_cast<double>(state.allocations()) / state.iterations();
+    allocatedBytes_ = static_cast<double>(state.allocatedBytes()) / state.iterations();
+    return finish(testResult_, state, iterations);
+  }
+
+  /// Grows the iteration count until one run takes at least the minimum
+  /// time. Returns the count and the seconds of its run, or 0 if a run failed.
+  /// A cold run also stops growing when evicting the caches made the whole
+  /// run take the minimum time.
+  std::size_t calibrate(Result& testResult_, double& seconds)
+  {
+    const BenchmarkClock& clock = BenchmarkClock::instance();
+    const std::size_t maxIterations = 1000000000;
+    std::size_t iterations = 1;
+    std::vector<LatencyHistogram> scratch(latency_ && !coldRun_ ? 1 : 0);
+    for (;;)
+    {
+      const uint64_t start = clock.now();
+      seconds = runOnce(testResult_, iterations, scratch.empty() ? 0 : &scratch[0]);
+      if (seconds < 0)
+        return 0;
+      const double wall = clock.toSeconds(clock.now() - start);
+      if (seconds >= settings().minTime || iterations >= maxIterations
+          || (coldRun_ && wall >= settings().minTime))
+        return iterations;
+      double factor = seconds > 0 ? settings().minTime * 1.4 / seconds : 10;
+      factor = std::max(2.0, std::min(factor, 10.0));
+      iterations = std::min(maxIterations, static_cast<std::size_t>(iterations * factor));
+    }
+  }
+
+  /// Runs batches of a tenth of the calibrated iterations until the time
+  /// per iteration of the last five batches varies by less than the warmup
+  /// threshold, or the warmup time is used up. Returns false if a run failed.
+  bool warmUp(Result& testResult_, std::size_t iterations, BenchmarkResult& result)
+  {
+    const BenchmarkSettings& config = settings();
+    if (config.warmupThreshold <= 0)
+      return true;
+    const BenchmarkClock& clock = BenchmarkClock::instance();
+    const std::size_t window = 5;
+    const std::size_t batch = std::max<std::size_t>(iterations / 10, 1);
+    const uint64_t start = clock.now();
+    std::vector<double> recent;
+    for (;;)
+    {
+      const double seconds = runOnce(testResult_, batch);
+      if (seconds < 0)
+        return false;
+      result.warmupIterations += batch;
+      result.warmupTime = clock.toSeconds(clock.now() - start);
+      recent.push_back(seconds / batch);
+      if (recent.size() > window)
+        recent.erase(recent.begin());
+      if (recent.size() == window)
+      {
+        const Statistics s = computeStatistics(recent);
+        if (s.mean > 0 && s.stddev / s.mean < config.warmupThreshold)
+          return true;
+      }
+      if (result.warmupTime >= config.maxWarmupTime)
+      {
+        result.steady = false;
+        return true;
+      }
+    }
+  }
+
+protected:
+  /// Record the latency of every iteration, see BENCHMARK_LATENCY.
+  bool latency_;
+  /// Measure with cold caches too, see BENCHMARK_COLD.
+  bool cold_;
+  /// Where the loop allocates from, see BENCHMARK_ALLOCATORS.
+  Allocator allocator_;
+  /// Run the body on pinned threads released together, even a single one,
+  /// see BENCHMARK_THREADS.
+  bool threaded_;
+
+  /// Passes the measurements of a completed benchmark to the writer and
+  /// the baselines of the settings.
+  virtual void report(Result& testResult_, const BenchmarkResult& result)
+  {
+    testResult_.out_.benchmark(result);
+    if (settings().record)
+      settings().record->add(result);
+    if (settings().compareTo)
+    {
+      std::string regression = settings().compareTo->check(result, settings().regressionThreshold);
+      if (!regression.empty() && result.unreliable)
+        regression += " (unreliable, the machine was busy)";
+      if (!regression.empty())
+        testResult_.addFailure(getFile(), getLine(), regression.c_str());
+    }
+  }
+
+private:
+  /// Returns the seconds of a run scaled to the requested iterations, as a
+  /// batched loop may run more.
+  double finish(Result& testResult_, const BenchmarkState& state, std::size_t iterations)
+  {
+    if (!testResult_.pass_)
+      return -1;
+    if (!state.finished())
+    {
+      testResult_.addFailure(getFile(), getLine(), "Benchmark body must loop while state.keepRunning()");
+      return -1;
+    }
+    return state.elapsed() * iterations / state.iterations();
+  }
+
+#ifdef CPPUT_HAS_THREADS
+  /// Failures of one benchmark thread, merged into the result after join.
+  struct ThreadFailures : public ResultWriter
+  {
+    struct Failure
+    {
+      std::string filename;
+      std::size_t line;
+      std::string message;
+    };
+
+    virtual void startTest(const std::string&, const std::string&) {}
+    virtual void endTest(bool) {}
+    virtual void failure(const std::string& filename, std::size_t line, const std::string& message)
+    {
+      Failure f;
+      f.filename = filename;
+      f.line = line;
+      f.message = message;
+      failures.push_back(f);
+    }
+    virtual int getNumberOfFailures() const { return static_cast<int>(failures.size()); }
+
+    std::vector<Failure> failures;
+  };
+
+  struct Thread
+  {
+    Benchmark*       benchmark;
+    Barrier*         barrier;
+    const bool*      aborted;
+    std::size_t      index;
+    int              cpu;
+    bool             pinned;
+    std::size_t      iterations;
+    pthread_t        thread;
+    ThreadFailures   failures;
+    double           seconds;
+    LatencyHistogram* histogram;
+    bool             corrected;
+    double           bytes;
+    double           items;
+    double           allocations;
+    double           allocatedBytes;
+  };
+
+  static void* threadMain(void* arg)
+  {
+    Thread* t = static_cast<Thread*>(arg);
+#ifdef CPPUT_HAS_AFFINITY
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(t->cpu, &cpus);
+    t->pinned = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+#endif
+    Benchmark& benchmark = *t->benchmark;
+    Result threadResult(benchmark.getClassName(), benchmark.getName(), t->failures);
+    BenchmarkState state(t->iterations, benchmark.range_, t->index, benchmark.threads_, t->histogram);
+    state.setColdCache(benchmark.coldRun_ ? &benchmark.evictionBuffers_[t->index] : 0);
+    state.setAllocator(benchmark.allocator_);
+    t->barrier->wait();
+    if (*t->aborted)
+      return 0;
+    benchmark.do_benchmark(threadResult, state);
+    t->corrected = state.corrected();
+    t->bytes = state.bytesProcessed() / state.iterations();
+    t->items = state.itemsProcessed() / state.iterations();
+    t->allocations = static_cast<double>(state.allocations()) / state.iterations();
+    t->allocatedBytes = static_cast<double>(state.allocatedBytes()) / state.iterations();
+    t->seconds = benchmark.finish(threadResult, state, t->iterations);
+    return 0;
+  }
+
+  double runThreads(Result& testResult_, std::size_t iterations, LatencyHistogram* histogram)
+  {
+    Barrier barrier(threads_);
+    bool aborted = false;
+    const std::vector<int> cpus = allowedCpus();
+    std::vector<Thread> threads(threads_);
+    std::vector<LatencyHistogram> histograms(histogram ? threads_ : 0);
+    std::size_t started = 0;
+    for (; started < threads_; ++started)
+    {
+      const std::size_t i = started;
+      threads[i].benchmark = this;
+      threads[i].barrier = &barrier;
+      threads[i].aborted = &aborted;
+      threads[i].index = i;
+      threads[i].cpu = cpus[i % cpus.size()];
+      threads[i].pinned = true;
+      threads[i].iterations = iterations;
+      threads[i].seconds = -1;
+      threads[i].histogram = histogram ? &histograms[i] : 0;
+      threads[i].corrected = false;
+      threads[i].bytes = 0;
+      threads[i].items = 0;
+      threads[i].allocations = 0;
+      threads[i].allocatedBytes = 0;
+      if (pthread_create(&threads[i].thread, 0, &Benchmark::threadMain, &threads[i]) != 0)
+        break;
+    }
+
+    // Timings on fewer threads than the benchmark is named after would be
+    // misleading, so the threads that did start are released without
+    // running the body.
+    if (started < threads_)
+    {
+      aborted = true;
+      for (std::size_t i = started; i < threads_; ++i)
+        barrier.leave();
+      for (std::size_t i = 0; i < started; ++i)
+        pthread_join(threads[i].thread, 0);
+      std::ostringstream message;
+      message << "Cannot start thread " << started + 1 << " of " << threads_;
+      testResult_.addFailure(getFile(), getLine(), message.str().c_str());
+      return -1;
+    }
+
+    double seconds = 0;
+    bytes_ = items_ = allocations_ = allocatedBytes_ = 0;
+    for (std::size_t i = 0; i < threads_; ++i)
+    {
+      pthread_join(threads[i].thread, 0);
+      if (!threads[i].pinned && !unpinnedWarned_)
+      {
+        std::cerr << "Warning: cannot pin thread " << i << " of " << getClassName() << '.' << getName()
+                  << " to CPU " << threads[i].cpu << ", benchmark timings may vary\n";
+        unpinnedWarned_ = true;
+      }
+      bytes_ += threads[i].bytes;
+      items_ += threads[i].items;
+      allocations_ += threads[i].allocations / threads_;
+      allocatedBytes_ += threads[i].allocatedBytes / threads_;
+      const std::vector<ThreadFailures::Failure>& failures = threads[i].failures.failures;
+      for (std::size_t f = 0; f < failures.size(); ++f)
+        testResult_.addFailure(failures[f].filename.c_str(), failures[f].line, failures[f].message.c_str());
+      seconds = std::max(seconds, threads[i].seconds);
+      corrected_ = corrected_ || threads[i].corrected;
+      if (histogram)
+        histogram->add(histograms[i]);
+    }
+    return testResult_.pass_ ? seconds : -1;
+  }
+#endif
+
+  virtual void do_run(Result& testResult_)
+  {
+    const BenchmarkSettings& config = settings();
+    if ((allocator_ == ArenaAllocator || allocator_ == HugePageAllocator) && !AllocationCounter::installed())
+    {
+      testResult_.addFailure(getFile(), getLine(), "Arena allocators need CPPUT_COUNT_ALLOCATIONS defined in one source file");
+      return;
+    }
+    SystemLoad load(allowedCpus());
+    load.start();
+    double seconds = 0;
+    const std::size_t iterations = calibrate(testResult_, seconds);
+    if (iterations == 0)
+      return;
+
+    BenchmarkResult result;
+    if (!warmUp(testResult_, iterations, result))
+      return;
+
+    // The histogram only holds the repetitions after calibration, and the
+    // calibration run only counts if it was not followed by a warmup.
+    std::vector<LatencyHistogram> histogram(latency_ ? 1 : 0);
+    corrected_ = false;
+    std::vector<double> samples(latency_ || result.warmupIterations > 0 ? 0 : 1, seconds / iterations);
+    PerfProbe perf;
+    if (PerfProbe::enabled())
+      perf.start();
+    std::size_t counted = 0;
+    double allocations = allocations_;
+    double allocatedBytes = allocatedBytes_;
+    std::size_t runs = 0;
+    while (samples.size() < config.repetitions)
+    {
+      seconds = runOnce(testResult_, iterations, latency_ ? &histogram[0] : 0);
+      if (seconds < 0)
+        return;
+      samples.push_back(seconds / iterations);
+      counted += iterations * threads_;
+      allocations = (allocations * runs + allocations_) / (runs + 1);
+      allocatedBytes = (allocatedBytes * runs + allocatedBytes_) / (runs + 1);
+      runs++;
+    }
+
+    result.className = getClassName();
+    result.name = getName();
+    result.iterations = iterations;
+    result.repetitions = samples.size();
+    result.range = range_;
+    result.threads = threads_;
+    result.time = computeStatistics(samples);
+    if (result.time.median > 0)
+    {
+      result.bytesPerSecond = bytes_ / result.time.median;
+      result.itemsPerSecond = items_ / result.time.median;
+    }
+    if (PerfProbe::enabled())
+      result.counters = perf.read().per(static_cast<double>(counted));
+    if (AllocationCounter::installed())
+    {
+      result.allocationsCounted = true;
+      result.allocations = allocations;
+      result.allocatedBytes = allocatedBytes;
+    }
+    if ((cold_ || config.coldCache) && !measureCold(testResult_, result))
+      return;
+    result.systemLoad = load.otherLoad();
+    result.unreliable = result.systemLoad > config.noiseThreshold;
+    report(testResult_, result);
+    if (latency_)
+    {
+      LatencyResult latency = summarizeLatency(histogram[0]);
+      latency.className = result.className;
+      latency.name = result.name;
+      latency.corrected = corrected_;
+      testResult_.out_.latency(latency);
+    }
+  }
+
+  /// Repeats the measurement with the caches evicted before every
+  /// iteration. Returns false if a run failed.
+  bool measureCold(Result& testResult_, BenchmarkResult& result)
+  {
+    // Every thread evicts through a buffer of its own, kept only for the
+    // cold run.
+    coldRun_ = true;
+    evictionBuffers_.assign(std::max<std::size_t>(threads_, 1), std::vector<char>(2 * lastLevelCacheSize()));
+    double seconds = 0;
+    const std::size_t iterations = calibrate(testResult_, seconds);
+    std::vector<double> samples(1, seconds / iterations);
+    while (iterations != 0 && samples.size() < settings().repetitions)
+    {
+      seconds = runOnce(testResult_, iterations);
+      if (seconds < 0)
+        break;
+      samples.push_back(seconds / iterations);
+    }
+    coldRun_ = false;
+    std::vector<std::vector<char> >().swap(evictionBuffers_);
+    if (!testResult_.pass_)
+      return false;
+    result.coldIterations = iterations;
+    result.coldTime = computeStatistics(samples);
+    return true;
+  }
+
+  virtual void do_benchmark(Result& testResult_, BenchmarkState& state) = 0;
+
+private:
+  std::size_t range_;
+  std::size_t threads_;
+  bool        corrected_;
+  bool        unpinnedWarned_;
+  bool        coldRun_;
+  std::vector<std::vector<char> > evictionBuffers_;
+  double      bytes_;  ///< per iteration of the last run, summed over threads
+  double      items_;
+  double      allocations_;    ///< per iteration of the last run and thread
+  double      allocatedBytes_;
+};
+
+/// A benchmark body run for a series of parameters, each registered as a
+/// benchmark of its own so that it can be selected with --filter.
+///
+/// A range family runs over a geometric range of input sizes, named
+/// "<name>/<size>". After a run the complexity is fitted to the sizes that
+/// ran and reported as "<name>/BigO", which fails when it grows faster than
+/// the declared bound.
+///
+/// A thread family runs the body on 1, 2, 4, ... threads, named
+/// "<name>/threads_<n>". After a run the throughput at each thread count is
+/// reported as "<name>/scaling".
+///
+/// An allocator family runs the body with its allocations served by malloc,
+/// a bump arena and a bump arena on huge pages, named "<name>/malloc",
+/// "<name>/arena" and "<name>/huge_pages". After a run the times are
+/// reported side by side as "<name>/allocators".
+class BenchmarkFamily
+{
+public:
+  typedef void (*Function)(Result& testResult_, BenchmarkState& state);
+
+  BenchmarkFamily(const char* className, const char* name, const char* file, std::size_t line,
+                  std::size_t first, std::size_t last, Complexity bound, Function function)
+    : className_(className)
+    , name_(name)
+    , file_(file)
+    , line_(line)
+    , kind_(Range)
+    , bound_(bound)
+    , function_(function)
+  {
+    const std::size_t multiplier = 8;
+    for (std::size_t size = std::max<std::size_t>(first, 1); size < last; size *= multiplier)
+      parameters_.push_back(size);
+    parameters_.push_back(last);
+    registerMembers("/");
+  }
+
+  /// Thread family up to maxThreads threads, or the number of CPUs if 0.
+  BenchmarkFamily(const char* className, const char* name, const char* file, std::size_t line,
+                  std::size_t maxThreads, Function function)
+    : className_(className)
+    , name_(name)
+    , file_(file)
+    , line_(line)
+    , kind_(Threads)
+    , bound_(OAny)
+    , function_(function)
+  {
+    if (maxThreads == 0)
+      maxThreads = onlineCpus();
+    for (std::size_t threads = 1; threads < maxThreads; threads *= 2)
+      parameters_.push_back(threads);
+    parameters_.push_back(maxThreads);
+    registerMembers("/threads_");
+  }
+
+  /// Allocator family.
+  BenchmarkFamily(const char* className, const char* name, const char* file, std::size_t line,
+                  Function function)
+    : className_(className)
+    , name_(name)
+    , file_(file)
+    , line_(line)
+    , kind_(Allocators)
+    , bound_(OAny)
+    , function_(function)
+  {
+    parameters_.push_back(MallocAllocator);
+    parameters_.push_back(ArenaAllocator);
+    parameters_.push_back(HugePageAllocator);
+    registerMembers("/");
+  }
+
+  ~BenchmarkFamily()
+  {
+    for (std::size_t i = 0; i < benchmarks_.size(); ++i)
+      delete benchmarks_[i];
+  }
+
+  /// Input sizes, thread counts or allocators of the members.
+  const std::vector<std::size_t>& parameters() const { return parameters_; }
+
+  /// Reports the complexity, scaling or allocator comparison of every
+  /// family with at least two measured members since the last call.
+  static void reportAll(ResultWriter& writer)
+  {
+    for (std::size_t i = 0; i < families().size(); ++i)
+      families()[i]->report(writer);
+  }
+
+private:
+  enum Kind
+  {
+    Range,
+    Threads,
+    Allocators
+  };
+
+  class Member : public Benchmark
+  {
+  public:
+    Member(BenchmarkFamily& family, const char* name, std::size_t parameter)
+      : Benchmark(family.className_, name, family.file_, family.line_,
+                  family.kind_ == Range ? parameter : 0,
+                  family.kind_ == Threads ? parameter : 1)
+      , family_(family)
+      , parameter_(parameter)
+    {
+      if (family.kind_ == Allocators)
+        allocator_ = static_cast<Allocator>(parameter);
+      threaded_ = family.kind_ == Threads;
+    }
+
+  private:
+    virtual void report(Result& testResult_, const BenchmarkResult& result)
+    {
+      Benchmark::report(testResult_, result);
+      family_.measuredParameters_.push_back(parameter_);
+      family_.measuredTimes_.push_back(result.time.median);
+    }
+
+    virtual void do_benchmark(Result& testResult_, BenchmarkState& state)
+    {
+      family_.function_(testResult_, state);
+    }
+
+    BenchmarkFamily& family_;
+    std::size_t      parameter_;
+  };
+
+  void registerMembers(const char* separator)
+  {
+    for (std::size_t i = 0; i < parameters_.size(); ++i)
+    {
+      std::ostringstream ss;
+      ss << name_ << separator;
+      if (kind_ == Allocators)
+        ss << allocatorName(static_cast<Allocator>(parameters_[i]));
+      else
+        ss << parameters_[i];
+      benchmarks_.push_back(new Member(*this, ss.str().c_str(), parameters_[i]));
+    }
+    families().push_back(this);
+  }
+
+  void report(ResultWriter& writer)
+  {
+    if (measuredParameters_.size() >= 2)
+    {
+      if (kind_ == Range)
+        fit(writer);
+      else if (kind_ == Threads)
+        scale(writer);
+      else
+        compareAllocators(writer);
+    }
+    measuredParameters_.clear();
+    measuredTimes_.clear();
+  }
+
+  void fit(ResultWriter& writer)
+  {
+    const std::vector<double> sizes(measuredParameters_.begin(), measuredParameters_.end());
+    ComplexityResult result = fitComplexity(sizes, measuredTimes_);
+    result.className = className_;
+    result.name = name_ + "/BigO";
+    result.bound = bound_;
+
+    Result testResult_(result.className, result.name, writer);
+    writer.complexity(result);
+    if (result.exceedsBound())
+    {
+      std::string message = "Fitted complexity ";
+      message += complexityName(result.complexity);
+      message += " exceeds the declared bound ";
+      message += complexityName(bound_);
+      testResult_.addFailure(file_, line_, message.c_str());
+    }
+  }
+
+  void scale(ResultWriter& writer)
+  {
+    ScalingResult result = computeScaling(measuredParameters_, measuredTimes_);
+    result.className = className_;
+    result.name = name_ + "/scaling";
+
+    Result testResult_(result.className, result.name, writer);
+    writer.scaling(result);
+  }
+
+  void compareAllocators(ResultWriter& writer)
+  {
+    AllocatorsResult result;
+    result.className = className_;
+    result.name = name_ + "/allocators";
+    for (std::size_t i = 0; i < measuredParameters_.size(); ++i)
+      result.allocators.push_back(static_cast<Allocator>(measuredParameters_[i]));
+    result.times = measuredTimes_;
+    result.hugePages = transparentHugePagesEnabled();
+
+    Result testResult_(result.className, result.name, writer);
+    writer.allocators(result);
+  }
+
+  static std::vector<BenchmarkFamily*>& families()
+  {
+    static std::vector<BenchmarkFamily*> f;
+    return f;
+  }
+
+  BenchmarkFamily(const BenchmarkFamily& other);
+  BenchmarkFamily& operator=(const BenchmarkFamily& rhs);
+
+private:
+  const char*               className_;
+  std::string               name_;
+  const char*               file_;
+  std::size_t               line_;
+  Kind                      kind_;
+  Complexity                bound_;
+  Function                  function_;
+  std::vector<std::size_t>  parameters_;
+  std::vector<Benchmark*>   benchmarks_;
+  std::vector<std::size_t>  measuredParameters_;
+  std::vector<double>       measuredTimes_;
+};
+
+/// Compares two benchmarks of a group by running them in the same process
+/// with their runs interleaved, so that drift in the machine state affects
+/// both alike. Each benchmark is calibrated on its own, then the two run in
+/// alternating order for a number of rounds. The comparison fails when the
+/// candidate is significantly slower than the baseline.
+class BenchmarkComparison : public Test
+{
+public:
+  BenchmarkComparison(const char* className, const char* baseline, const char* candidate,
+                      const char* name, const char* file, std::size_t line)
+    : Test(className, name, file, line, IsBenchmark)
+    , baseline_(baseline)
+    , candidate_(candidate)
+  {
+  }
+
+  /// Number of interleaved rounds for the given number of repetitions. The
+  /// statistical tests need more samples than a single benchmark.
+  static std::size_t rounds(std::size_t repetitions)
+  {
+    return std::max<std::size_t>(repetitions * 2, 10);
+  }
+
+private:
+  virtual void do_run(Result& testResult_)
+  {
+    Benchmark* baseline = find(testResult_, baseline_);
+    Benchmark* candidate = find(testResult_, candidate_);
+    if (!baseline || !candidate)
+      return;
+
+    double seconds = 0;
+    const std::size_t baselineIterations = baseline->calibrate(testResult_, seconds);
+    const std::size_t candidateIterations = baselineIterations ? candidate->calibrate(testResult_, seconds) : 0;
+    if (candidateIterations == 0)
+      return;
+
+    // Both warm up after calibration like a single benchmark, so that the
+    // first rounds do not measure lazy initialization of either.
+    BenchmarkResult baselineWarmup;
+    BenchmarkResult candidateWarmup;
+    if (!baseline->warmUp(testResult_, baselineIterations, baselineWarmup)
+        || !candidate->warmUp(testResult_, candidateIterations, candidateWarmup))
+      return;
+
+    // Alternate which variant goes first to cancel out ordering effects.
+    const std::size_t count = rounds(Benchmark::settings().repetitions);
+    std::vector<double> baselineTimes;
+    std::vector<double> candidateTimes;
+    for (std::size_t round = 0; round < count; ++round)
+    {
+      for (std::size_t turn = 0; turn < 2; ++turn)
+      {
+        const bool runBaseline = (round + turn) % 2 == 0;
+        Benchmark* benchmark = runBaseline ? baseline : candidate;
+        const std::size_t iterations = runBaseline ? baselineIterations : candidateIterations;
+        seconds = benchmark->runOnce(testResult_, iterations);
+        if (seconds < 0)
+          return;
+        (runBaseline ? baselineTimes : candidateTimes).push_back(seconds / iterations);
+      }
+    }
+
+    ComparisonResult result = compareSamples(baselineTimes, candidateTimes);
+    result.className = getClassName();
+    result.name = getName();
+    result.baseline = baseline_;
+    result.candidate = candidate_;
+    testResult_.out_.comparison(result);
+    if (result.significant() && result.speedup < 1)
+    {
+      std::ostringstream message;
+      message << std::setprecision(3) << candidate_ << " is significantly slower than "
+              << baseline_ << ", speedup " << result.speedup << "x";
+      testResult_.addFailure(getFile(), getLine(), message.str().c_str());
+    }
+  }
+
+  Benchmark* find(Result& testResult_, const char* name)
+  {
+    Benchmark* benchmark = dynamic_cast<Benchmark*>(Repository::instance().find(getClassName(), name));
+    if (!benchmark)
+    {
+      std::string message = "Unknown benchmark ";
+      message += getClassName();
+      message += ".";
+      message += name;
+      testResult_.addFailure(getFile(), getLine(), message.c_str());
+    }
+    return benchmark;
+  }
+
+private:
+  const char* baseline_;
+  const char* candidate_;
+};
+
+// ----------------------------------------------------------------------------
+
+/// Glob pattern compiled for fast matching against many test names.
+///
+/// '*' matches any sequence and '?' any single character. The pattern is
+/// split at its stars into segments once; matching then anchors the first
+/// and last segment and finds the others left to right at their leftmost
+/// position, which never needs to backtrack.
+class GlobPattern
 {
-  virtual ~ResultWriter() {}
-  
-  virtual void startTest(const std::string& className, const std::string& name) = 0;
-  virtual void endTest(bool success) = 0;
-  
-  virtual void failure(const std::string& filename, std::size_t line, const std::string& message) = 0;
-  virtual int getNumberOfFailures() const = 0;
+public:
+  explicit GlobPattern(const std::string& pattern)
+    : anchoredBegin_(pattern.empty() || pattern[0] != '*')
+    , anchoredEnd_(pattern.empty() || pattern[pattern.size() - 1] != '*')
+  {
+    std::size_t begin = 0;
+    while (begin <= pattern.size())
+    {
+      std::size_t end = pattern.find('*', begin);
+      if (end == std::string::npos)
+        end = pattern.size();
+      if (end > begin)
+        segments_.push_back(pattern.substr(begin, end - begin));
+      begin = end + 1;
+    }
+    // Only the empty pattern needs an empty name, "*" matches everything.
+    if (segments_.empty())
+      anchoredBegin_ = pattern.empty();
+  }
+
+  bool matches(const std::string& text) const
+  {
+    std::size_t first = 0;
+    std::size_t last = segments_.size();
+    std::size_t pos = 0;
+    std::size_t end = text.size();
+
+    if (segments_.empty())
+      return !anchoredBegin_ || text.empty();
+    if (anchoredBegin_)
+    {
+      if (!matchAt(segments_[0], text, 0))
+        return false;
+      pos = segments_[0].size();
+      first = 1;
+    }
+    if (anchoredEnd_ && first < last)
+    {
+      const std::string& tail = segments_[last - 1];
+      if (tail.size() > end - pos || !matchAt(tail, text, end - tail.size()))
+        return false;
+      end -= tail.size();
+      last--;
+    }
+    else if (anchoredEnd_ && pos != end)
+      return false;
+
+    for (std::size_t i = first; i < last; ++i)
+    {
+      const std::string& segment = segments_[i];
+      while (pos + segment.size() <= end && !matchAt(segment, text, pos))
+        ++pos;
+      if (pos + segment.size() > end)
+        return false;
+      pos += segment.size();
+    }
+    return true;
+  }
+
+private:
+  static bool matchAt(const std::string& segment, const std::string& text, std::size_t pos)
+  {
+    if (segment.size() > text.size() - pos)
+      return false;
+    for (std::size_t i = 0; i < segment.size(); ++i)
+      if (segment[i] != '?' && segment[i] != text[pos + i])
+        return false;
+    return true;
+  }
+
+private:
+  std::vector<std::string> segments_;
+  bool                     anchoredBegin_;
+  bool                     anchoredEnd_;
+};
+
+#ifdef CPPUT_HAS_REGEX
+
+/// POSIX extended regular expression that has to match a whole name, like
+/// a glob pattern. It is compiled once; a pattern that does not compile is
+/// not valid() and matches nothing.
+class RegexPattern
+{
+public:
+  explicit RegexPattern(const std::string& pattern)
+    : pattern_(pattern)
+  {
+    compile();
+  }
+
+  RegexPattern(const RegexPattern& other)
+    : pattern_(other.pattern_)
+  {
+    compile();
+  }
+
+  RegexPattern& operator=(const RegexPattern& rhs)
+  {
+    if (this != &rhs)
+    {
+      release();
+      pattern_ = rhs.pattern_;
+      compile();
+    }
+    return *this;
+  }
+
+  ~RegexPattern()
+  {
+    release();
+  }
+
+  bool valid() const { return valid_; }
+
+  bool matches(const std::string& text) const
+  {
+    return valid_ && regexec(&regex_, text.c_str(), 0, 0, 0) == 0;
+  }
+
+private:
+  void compile()
+  {
+    valid_ = regcomp(&regex_, ("^(" + pattern_ + ")$").c_str(), REG_EXTENDED | REG_NOSUB) == 0;
+  }
+
+  void release()
+  {
+    if (valid_)
+      regfree(&regex_);
+    valid_ = false;
+  }
+
+private:
+  std::string pattern_;
+  regex_t     regex_;
+  bool        valid_;
+};
+
+#endif
+
+/// Selects tests by their "group.name".
+///
+/// The filter is a ':' separated list of positive patterns, optionally
+/// followed by '-' and a ':' separated list of negative patterns, e.g.
+/// "Foo.*:Bar.*-*.slow_*". A pattern is a glob, or a POSIX extended regular
+/// expression between slashes, e.g. "/Foo\.(get|set)_[a-z]+/", which may
+/// contain ':' and '-'. A test runs if it matches any positive pattern (all
+/// tests when there are none) and no negative one.
+class TestFilter
+{
+public:
+  TestFilter() : valid_(true) {}
+
+  explicit TestFilter(const std::string& filter)
+    : valid_(true)
+  {
+    bool negative = false;
+    std::size_t begin = 0;
+    while (begin < filter.size())
+    {
+      if (filter[begin] == ':')
+        begin++;
+      else if (filter[begin] == '-' && !negative)
+      {
+        negative = true;
+        begin++;
+      }
+      else if (filter[begin] == '/')
+        begin = addRegex(filter, begin, negative);
+      else
+      {
+        std::size_t end = filter.find_first_of(negative ? ":" : ":-", begin);
+        if (end == std::string::npos)
+          end = filter.size();
+        (negative ? negative_ : positive_).push_back(GlobPattern(filter.substr(begin, end - begin)));
+        begin = end;
+      }
+    }
+  }
+
+  /// False if a regular expression does not compile, is not closed by a
+  /// slash, or is not supported on this platform.
+  bool valid() const { return valid_; }
+
+  bool matches(const std::string& fullName) const
+  {
+    bool selected = positive_.empty();
+#ifdef CPPUT_HAS_REGEX
+    selected = selected && positiveRegex_.empty();
+    for (std::size_t i = 0; !selected && i < positiveRegex_.size(); ++i)
+      selected = positiveRegex_[i].matches(fullName);
+#endif
+    for (std::size_t i = 0; !selected && i < positive_.size(); ++i)
+      selected = positive_[i].matches(fullName);
+    for (std::size_t i = 0; selected && i < negative_.size(); ++i)
+      selected = !negative_[i].matches(fullName);
+#ifdef CPPUT_HAS_REGEX
+    for (std::size_t i = 0; selected && i < negativeRegex_.size(); ++i)
+      selected = !negativeRegex_[i].matches(fullName);
+#endif
+    return selected;
+  }
+
+private:
+  /// Adds the regular expression starting with the slash at begin and
+  /// returns the position after its closing slash.
+  std::size_t addRegex(const std::string& filter, std::size_t begin, bool negative)
+  {
+    std::size_t end = begin + 1;
+    while (end < filter.size() && filter[end] != '/')
+      end += filter[end] == '\\' ? 2 : 1;
+    if (end >= filter.size())
+    {
+      valid_ = false;
+      return filter.size();
+    }
+#ifdef CPPUT_HAS_REGEX
+    const RegexPattern regex(filter.substr(begin + 1, end - begin - 1));
+    valid_ = valid_ && regex.valid();
+    (negative ? negativeRegex_ : positiveRegex_).push_back(regex);
+#else
+    (void)negative;
+    valid_ = false;
+#endif
+    return end + 1;
+  }
+
+private:
+  std::vector<GlobPattern>  positive_;
+  std::vector<GlobPattern>  negative_;
+#ifdef CPPUT_HAS_REGEX
+  std::vector<RegexPattern> positiveRegex_;
+  std::vector<RegexPattern> negativeRegex_;
+#endif
+  bool                      valid_;
 };
 
 // ----------------------------------------------------------------------------
 
-class TextResultWriter : public ResultWriter
+/// Settings of a test run, usually parsed from the command line.
+struct Options
+{
+  Options()
+    : xml(false)
+    , listTests(false)
+    , benchmarks(false)
+    , perfCounters(false)
+    , jobs(1)
+    , processes(0)
+    , testsPerProcess(0)
+    , totalShards(1)
+    , shardIndex(0)
+    , timeout(0)
+    , slowest(0)
+  {
+    if (const char* total = std::getenv("CPPUT_TOTAL_SHARDS"))
+      totalShards = parseNumber(total, 1);
+    if (const char* index = std::getenv("CPPUT_SHARD_INDEX"))
+      shardIndex = parseNumber(index, 0);
+    if (const char* status = std::getenv("CPPUT_SHARD_STATUS_FILE"))
+      shardStatusFile = status;
+  }
+
+  /// Parses the command line. Prints a message and returns false for
+  /// arguments that are not understood.
+  bool parse(int argc, char* argv[])
+  {
+    for (int i = 1; i < argc; ++i)
+    {
+      const std::string arg(argv[i]);
+      if (arg == "--xml")
+        xml = true;
+      else if (arg == "--list-tests")
+        listTests = true;
+      else if (arg == "--benchmarks")
+        benchmarks = true;
+      else if (arg == "--perf-counters")
+        perfCounters = true;
+      else if (arg == "--cold-cache")
+        benchmark.coldCache = true;
+      else if (arg.compare(0, 21, "--benchmark-min-time=") == 0)
+        benchmark.minTime = std::strtod(arg.c_str() + 21, 0);
+      else if (arg.compare(0, 24, "--benchmark-repetitions=") == 0)
+        benchmark.repetitions = parseNumber(arg.substr(24), 1);
+      else if (arg.compare(0, 16, "--save-baseline=") == 0)
+        saveBaseline = arg.substr(16);
+      else if (arg.compare(0, 19, "--compare-baseline=") == 0)
+        compareBaseline = arg.substr(19);
+      else if (arg.compare(0, 23, "--regression-threshold=") == 0)
+        benchmark.regressionThreshold = std::strtod(arg.c_str() + 23, 0) / 100;
+      else if (arg.compare(0, 19, "--warmup-threshold=") == 0)
+        benchmark.warmupThreshold = std::strtod(arg.c_str() + 19, 0) / 100;
+      else if (arg.compare(0, 13, "--max-warmup=") == 0)
+        benchmark.maxWarmupTime = std::strtod(arg.c_str() + 13, 0);
+      else if (arg.compare(0, 18, "--noise-threshold=") == 0)
+        benchmark.noiseThreshold = std::strtod(arg.c_str() + 18, 0) / 100;
+      else if (arg.compare(0, 17, "--benchmark-cpus=") == 0)
+      {
+        if (!parseCpuList(arg.substr(17), benchmarkCpus))
+        {
+          std::cerr << "Invalid CPU list: " << arg.substr(17) << "\n";
+          return false;
+        }
+      }
+      else if (arg.compare(0, 9, "--filter=") == 0)
+        filter = arg.substr(9);
+      else if (arg.compare(0, 7, "--jobs=") == 0)
+        jobs = parseCount(arg.substr(7));
+      else if (arg.compare(0, 12, "--processes=") == 0)
+        processes = parseCount(arg.substr(12));
+      else if (arg.compare(0, 20, "--tests-per-process=") == 0)
+        testsPerProcess = parseCount(arg.substr(20));
+      else if (arg.compare(0, 15, "--total-shards=") == 0)
+        totalShards = parseNumber(arg.substr(15), 1);
+      else if (arg.compare(0, 14, "--shard-index=") == 0)
+        shardIndex = parseNumber(arg.substr(14), 0);
+      else if (arg.compare(0, 10, "--timeout=") == 0)
+        timeout = static_cast<unsigned>(parseNumber(arg.substr(10), 0));
+      else if (arg == "--slowest")
+        slowest = 10;
+      else if (arg.compare(0, 10, "--slowest=") == 0)
+        slowest = parseNumber(arg.substr(10), 10);
+      else
+      {
+        std::cerr << "Unknown option: " << arg << "\n"
+                  << "Usage: " << argv[0] << " [--xml] [--list-tests] [--filter=PATTERNS]"
+                  << " [--jobs=N] [--processes=N] [--tests-per-process=N]"
+                  << " [--total-shards=N --shard-index=I] [--timeout=MS] [--slowest[=N]] [--perf-counters]"
+                  << " [--benchmarks [--benchmark-min-time=S] [--benchmark-repetitions=N] [--cold-cache]"
+                  << " [--warmup-threshold=PERCENT] [--max-warmup=S]"
+                  << " [--benchmark-cpus=LIST] [--noise-threshold=PERCENT]"
+                  << " [--save-baseline=FILE] [--compare-baseline=FILE] [--regression-threshold=PERCENT]]\n";
+        return false;
+      }
+    }
+    if (testsPerProcess > 0 && processes == 0)
+      processes = 1;
+    if (!TestFilter(filter).valid())
+    {
+      std::cerr << "Invalid regular expression in --filter=" << filter << "\n";
+      return false;
+    }
+    if (!benchmarks && (!saveBaseline.empty() || !compareBaseline.empty()))
+    {
+      std::cerr << "--save-baseline and --compare-baseline require --benchmarks\n";
+      return false;
+    }
+    return validShard();
+  }
+
+  /// Checks that the shard index is within the number of shards and prints
+  /// a message if it is not.
+  bool validShard() const
+  {
+    if (totalShards > 0 && shardIndex < totalShards)
+      return true;
+    std::cerr << "Invalid shard " << shardIndex << " of " << totalShards << " shards.\n";
+    return false;
+  }
+
+  bool        xml;
+  /// Print the selected tests instead of running them.
+  bool        listTests;
+  /// Run the benchmarks instead of the tests.
+  bool        benchmarks;
+  /// Count hardware events of every test and benchmark.
+  bool        perfCounters;
+  BenchmarkSettings benchmark;
+  /// CPUs the benchmarks are pinned to; empty to not pin them.
+  std::vector<int> benchmarkCpus;
+  /// File the benchmark results are written to.
+  std::string saveBaseline;
+  /// File with benchmark results to check for regressions against.
+  std::string compareBaseline;
+  /// Glob and regular expression patterns over "group.name", see TestFilter.
+  std::string filter;
+  std::size_t jobs;
+  /// Number of worker processes; 0 runs the tests in this process.
+  std::size_t processes;
+  /// Tests a worker process runs before it is replaced by a fresh fork;
+  /// 0 keeps workers for the whole run.
+  std::size_t testsPerProcess;
+  /// Runs only the tests assigned to shard shardIndex out of totalShards.
+  /// Defaults to CPPUT_TOTAL_SHARDS and CPPUT_SHARD_INDEX.
+  std::size_t totalShards;
+  std::size_t shardIndex;
+  /// File created by the runner to show that it supports sharding.
+  /// Defaults to CPPUT_SHARD_STATUS_FILE.
+  std::string shardStatusFile;
+  /// Default wall-clock limit of a test in milliseconds; 0 for none.
+  unsigned    timeout;
+  /// Number of slowest tests and groups the text output reports at the end.
+  std::size_t slowest;
+
+private:
+  static std::size_t parseNumber(const std::string& value, std::size_t fallback)
+  {
+    char* end = 0;
+    const long n = std::strtol(value.c_str(), &end, 10);
+    return n >= 0 && end != value.c_str() && *end == '\0' ? static_cast<std::size_t>(n) : fallback;
+  }
+
+  static std::size_t parseCount(const std::string& value)
+  {
+    const long n = std::strtol(value.c_str(), 0, 10);
+#ifdef CPPUT_HAS_THREADS
+    if (n <= 0)
+      return onlineCpus();
+#endif
+    return n > 0 ? static_cast<std::size_t>(n) : 1;
+  }
+};
+
+// ----------------------------------------------------------------------------
+
+#ifdef CPPUT_HAS_THREADS
+
+/// Runs tests on a pool of worker threads.
+///
+/// Each worker starts with a contiguous slice of the tests and steals from
+/// the back of the other queues once its own is empty. Results are recorded
+/// per test and replayed on the calling thread in registration order, so the
+/// writer is never called concurrently and its output is the same as for a
+/// sequential run. Tests flagged Serial are run on the calling thread once
+/// all other tests have finished.
+class ParallelRunner
 {
 public:
-  TextResultWriter()
-    : testCount_(0)
-    , failures_(0)
+  ParallelRunner(const std::vector<Test*>& tests, std::size_t jobs)
+    : tests_(tests)
+    , jobs_(jobs)
+    , queues_(new WorkQueue[jobs])
+    , recorders_(tests.size())
+    , done_(tests.size(), false)
+    , remaining_(0)
   {
+    std::vector<std::size_t> parallel;
+    for (std::size_t i = 0; i < tests_.size(); ++i)
+      if (!(tests_[i]->getFlags() & Test::Serial))
+        parallel.push_back(i);
+    remaining_ = parallel.size();
+    for (std::size_t i = 0; i < parallel.size(); ++i)
+      queues_[i * jobs_ / parallel.size()].items.push_back(parallel[i]);
   }
 
-  virtual ~TextResultWriter()
+  ~ParallelRunner()
   {
-    if (failures_ == 0)
+    delete [] queues_;
+  }
+
+  int run(ResultWriter& writer)
+  {
+    // Workers steal from every queue, so the tests of workers that could
+    // not be started are run by the others. Without any worker the calling
+    // thread runs them all.
+    std::vector<Worker> workers(jobs_);
+    std::size_t started = 0;
+    for (std::size_t i = 0; i < jobs_; ++i)
     {
-      std::cout << "\nAll tests pass.\n";
-      return;
+      workers[i].runner = this;
+      workers[i].index = i;
+      workers[i].started = pthread_create(&workers[i].thread, 0, &ParallelRunner::workerMain, &workers[i]) == 0;
+      if (workers[i].started)
+        started++;
     }
-    std::cout << "\n" << failures_ << " out of " << testCount_ << " tests failed.\n";
+    if (started < jobs_)
+      std::cerr << "Cannot start " << jobs_ - started << " of " << jobs_ << " worker threads, running the tests on "
+                << std::max<std::size_t>(started, 1) << ".\n";
+    if (started == 0)
+      work(0);
+
+    for (std::size_t i = 0; i < tests_.size(); ++i)
+    {
+      // The tests run and replay without the lock, which the workers need
+      // to report finished tests.
+      const bool serial = (tests_[i]->getFlags() & Test::Serial) != 0;
+      {
+        Lock lock(mutex_);
+        while (serial ? remaining_ > 0 : !done_[i])
+          finished_.wait(mutex_);
+      }
+      if (serial)
+      {
+        tests_[i]->run(writer);
+        continue;
+      }
+      recorders_[i].replay(writer);
+      recorders_[i] = ResultRecorder();
+    }
+
+    for (std::size_t i = 0; i < jobs_; ++i)
+      if (workers[i].started)
+        pthread_join(workers[i].thread, 0);
+    return writer.getNumberOfFailures();
   }
 
-  virtual void startTest(const std::string&, const std::string&)
+private:
+  struct WorkQueue
   {
-    testCount_++;
+    Mutex                   mutex;
+    std::deque<std::size_t> items;
+  };
+
+  struct Worker
+  {
+    ParallelRunner* runner;
+    std::size_t     index;
+    pthread_t       thread;
+    bool            started;
+  };
+
+  static void* workerMain(void* arg)
+  {
+    Worker* worker = static_cast<Worker*>(arg);
+    worker->runner->work(worker->index);
+    return 0;
   }
 
-  virtual void endTest(bool success)
+  void work(std::size_t self)
   {
-    if (success)
-      std::cout << '.';
-    else
-      std::cout << 'F';
+    std::size_t test;
+    while (take(self, test))
+    {
+      tests_[test]->run(recorders_[test]);
+      Lock lock(mutex_);
+      done_[test] = true;
+      remaining_--;
+      finished_.broadcast();
+    }
   }
 
-  virtual void failure(const std::string& filename, std::size_t line, const std::string& message)
+  bool take(std::size_t self, std::size_t& test)
   {
-    failures_++;
-    std::cout << "Failure: " << filename << ", line " << line << ": " << message << '\n';
+    {
+      WorkQueue& own = queues_[self];
+      Lock lock(own.mutex);
+      if (!own.items.empty())
+      {
+        test = own.items.front();
+        own.items.pop_front();
+        return true;
+      }
+    }
+    for (std::size_t i = 1; i < jobs_; ++i)
+    {
+      WorkQueue& victim = queues_[(self + i) % jobs_];
+      Lock lock(victim.mutex);
+      if (!victim.items.empty())
+      {
+        test = victim.items.back();
+        victim.items.pop_back();
+        return true;
+      }
+    }
+    return false;
   }
 
-  virtual int getNumberOfFailures() const { return failures_; }
+  ParallelRunner(const ParallelRunner& other);
+  ParallelRunner& operator=(const ParallelRunner& rhs);
 
 private:
-  int testCount_;
-  int failures_;
+  const std::vector<Test*>&   tests_;
+  std::size_t                 jobs_;
+  WorkQueue*                  queues_;
+  std::vector<ResultRecorder> recorders_;
+  std::vector<bool>           done_;
+  std::size_t                 remaining_;
+  Mutex                       mutex_;
+  Condition                   finished_;
 };
 
+#endif // CPPUT_HAS_THREADS
+
 // ----------------------------------------------------------------------------
 
-class XmlResultWriter : public ResultWriter
+#ifdef CPPUT_HAS_FORK
+
+/// Runs tests in a pool of forked worker processes.
+///
+/// The workers are forked from the fully initialized runner and receive test
+/// indices over a pipe. Each finished test is sent back as an encoded
+/// ResultRecorder and replayed in registration order. When a worker dies the
+/// test it was running is reported as failed with the signal or exit status,
+/// and a fresh worker takes its place, so a crashing test only costs its own
+/// result. Tests flagged Serial run while no other test is in flight.
+///
+/// With testsPerProcess set, a worker is retired after running that many
+/// tests and replaced by a fresh fork of the runner. Every batch then starts
+/// from the copy-on-write state of the initialized binary, which isolates
+/// tests from each other for the cost of a fork instead of a new process.
+class ProcessPoolRunner
 {
 public:
-  XmlResultWriter()
-    : startTime_(0)
-    , failureCount_(0)
+  ProcessPoolRunner(const std::vector<Test*>& tests, std::size_t processes, std::size_t testsPerProcess = 0)
+    : tests_(tests)
+    , testsPerProcess_(testsPerProcess)
+    , workers_(processes)
+    , recorders_(tests.size())
+    , done_(tests.size(), false)
   {
-    std::cout << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
-    std::cout << "<testsuite>\n";
   }
 
-  virtual ~XmlResultWriter()
+  int run(ResultWriter& writer)
+  {
+    void (*previousHandler)(int) = signal(SIGPIPE, SIG_IGN);
+    for (std::size_t i = 0; i < workers_.size(); ++i)
+      spawn(i);
+
+    std::size_t next = 0;
+    std::size_t replayed = 0;
+    while (replayed < tests_.size())
+    {
+      next = dispatch(next);
+      for (; replayed < tests_.size() && done_[replayed]; ++replayed)
+      {
+        recorders_[replayed].replay(writer);
+        recorders_[replayed] = ResultRecorder();
+      }
+      if (replayed < tests_.size())
+        collect();
+    }
+
+    for (std::size_t i = 0; i < workers_.size(); ++i)
+      stop(workers_[i]);
+    signal(SIGPIPE, previousHandler);
+    return writer.getNumberOfFailures();
+  }
+
+private:
+  static const std::size_t idle = static_cast<std::size_t>(-1);
+
+  struct Worker
+  {
+    Worker() : pid(-1), commands(-1), results(-1), test(idle), ran(0) {}
+
+    pid_t       pid;
+    int         commands;
+    int         results;
+    std::size_t test;
+    std::size_t ran;
+    std::string buffer;
+  };
+
+  std::size_t busyWorkers() const
+  {
+    std::size_t busy = 0;
+    for (std::size_t i = 0; i < workers_.size(); ++i)
+      busy += workers_[i].test != idle;
+    return busy;
+  }
+
+  std::size_t dispatch(std::size_t next)
+  {
+    for (std::size_t i = 0; i < workers_.size() && next < tests_.size(); ++i)
+    {
+      Worker& w = workers_[i];
+      if (w.test != idle)
+        continue;
+      const bool serial = (tests_[next]->getFlags() & Test::Serial) != 0;
+      if (serial && busyWorkers() > 0)
+        break;
+      // If the worker died in the meantime, collect() reports the test as
+      // crashed when it sees the closed pipe.
+      w.test = next;
+      w.ran++;
+      writeAll(w.commands, &next, sizeof(next));
+      ++next;
+      if (serial)
+        break;
+    }
+    return next;
+  }
+
+  void collect()
+  {
+    std::vector<pollfd> fds;
+    std::vector<std::size_t> owners;
+    for (std::size_t i = 0; i < workers_.size(); ++i)
+    {
+      if (workers_[i].test == idle)
+        continue;
+      pollfd fd = { workers_[i].results, POLLIN, 0 };
+      fds.push_back(fd);
+      owners.push_back(i);
+    }
+    if (fds.empty() || poll(&fds[0], fds.size(), -1) <= 0)
+      return;
+
+    for (std::size_t i = 0; i < fds.size(); ++i)
+    {
+      if (!fds[i].revents)
+        continue;
+      Worker& w = workers_[owners[i]];
+      char chunk[4096];
+      const ssize_t n = read(w.results, chunk, sizeof(chunk));
+      if (n > 0)
+      {
+        w.buffer.append(chunk, n);
+        receive(owners[i]);
+      }
+      else if (n == 0 || errno != EINTR)
+        crashed(owners[i]);
+    }
+  }
+
+  void receive(std::size_t index)
+  {
+    Worker& w = workers_[index];
+    std::size_t size = 0;
+    if (w.buffer.size() < sizeof(size))
+      return;
+    w.buffer.copy(reinterpret_cast<char*>(&size), sizeof(size));
+    if (w.buffer.size() - sizeof(size) < size)
+      return;
+    const bool decoded = recorders_[w.test].decode(w.buffer.substr(sizeof(size), size));
+    w.buffer.erase(0, sizeof(size) + size);
+    if (!decoded)
+    {
+      // The results of the worker can no longer be told apart, so it is
+      // replaced like a crashed one.
+      recorders_[w.test] = ResultRecorder();
+      kill(w.pid, SIGKILL);
+      crashed(index, "Worker process sent a corrupt result");
+      return;
+    }
+    done_[w.test] = true;
+    w.test = idle;
+
+    if (testsPerProcess_ > 0 && w.ran >= testsPerProcess_)
+    {
+      stop(w);
+      w = Worker();
+      spawn(index);
+    }
+  }
+
+  /// Records a failure for the test of a worker that died, or that sent
+  /// something other than a result, and starts a new worker in its place.
+  void crashed(std::size_t index, const char* reason = 0)
   {
-    std::cout << "</testsuite>\n";
+    Worker& w = workers_[index];
+    int status = 0;
+    close(w.commands);
+    close(w.results);
+    waitpid(w.pid, &status, 0);
+
+    if (w.test != idle)
+    {
+      std::ostringstream message;
+      if (reason)
+        message << reason;
+      else if (WIFSIGNALED(status))
+        message << "Test crashed with signal " << WTERMSIG(status)
+                << " (" << strsignal(WTERMSIG(status)) << ")";
+      else if (WEXITSTATUS(status) == Watchdog::timeoutExitStatus)
+        message << "Test timed out and its worker process was terminated";
+      else
+        message << "Test terminated the worker process with exit status " << WEXITSTATUS(status);
+      Test* test = tests_[w.test];
+      ResultRecorder& r = recorders_[w.test];
+      r.startTest(test->getClassName(), test->getName());
+      r.failure(test->getFile(), test->getLine(), message.str());
+      r.endTest(false);
+      done_[w.test] = true;
+    }
+    w = Worker();
+    spawn(index);
   }
 
-  virtual void startTest(const std::string& className, const std::string& name)
+  void spawn(std::size_t index)
   {
-    startTime_ = std::clock();
-    std::cout << "  <testcase classname=\""
-              << className
-              << "\" name=\""
-              << name
-              << "\" time=\"";
+    int commands[2];
+    int results[2];
+    if (pipe(commands) != 0 || pipe(results) != 0)
+    {
+      std::perror("cpput: pipe");
+      std::exit(1);
+    }
+    std::cout.flush();
+    std::cerr.flush();
+    std::fflush(0);
+
+    const pid_t pid = fork();
+    if (pid == 0)
+    {
+      for (std::size_t i = 0; i < workers_.size(); ++i)
+        if (workers_[i].pid > 0)
+        {
+          close(workers_[i].commands);
+          close(workers_[i].results);
+        }
+      close(commands[1]);
+      close(results[0]);
+      Watchdog::instance().setAction(Watchdog::ExitProcess);
+      serve(commands[0], results[1]);
+    }
+    if (pid < 0)
+    {
+      std::perror("cpput: fork");
+      std::exit(1);
+    }
+    close(commands[0]);
+    close(results[1]);
+    workers_[index].pid = pid;
+    workers_[index].commands = commands[1];
+    workers_[index].results = results[0];
   }
 
-  virtual void endTest(bool success)
+  /// Worker process main loop; runs tests until the runner closes the pipe.
+  void serve(int commands, int results)
   {
-    if (success)
+    std::size_t test = 0;
+    while (readAll(commands, &test, sizeof(test)) && test < tests_.size())
     {
-      std::cout << static_cast<float>(std::clock()-startTime_)/CLOCKS_PER_SEC << "\"";
-      std::cout << "/>\n";
+      ResultRecorder recorder;
+      tests_[test]->run(recorder);
+      std::string message(sizeof(std::size_t), '\0');
+      recorder.encode(message);
+      const std::size_t size = message.size() - sizeof(size);
+      message.replace(0, sizeof(size), reinterpret_cast<const char*>(&size), sizeof(size));
+      std::cout.flush();
+      if (!writeAll(results, message.data(), message.size()))
+        break;
     }
-    else
-      std::cout << "  </testcase>\n";
+    std::cout.flush();
+    std::cerr.flush();
+    _exit(0);
   }
 
-  virtual void failure(const std::string& filename, std::size_t line, const std::string& message)
+  void stop(Worker& w)
   {
-    std::cout << static_cast<float>(std::clock()-startTime_)/CLOCKS_PER_SEC << "\"";
-    std::cout << ">\n"
-              << "    <failure>"
-              << message
-              << " in "
-              << filename
-              << ", line "
-              << line
-              << "</failure>\n";
-    failureCount_++;
+    close(w.commands);
+    close(w.results);
+    waitpid(w.pid, 0, 0);
   }
 
-  virtual int getNumberOfFailures() const
+  static bool readAll(int fd, void* data, std::size_t size)
   {
-    return failureCount_;
+    char* p = static_cast<char*>(data);
+    while (size > 0)
+    {
+      const ssize_t n = read(fd, p, size);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      p += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  static bool writeAll(int fd, const void* data, std::size_t size)
+  {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0)
+    {
+      const ssize_t n = write(fd, p, size);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      p += n;
+      size -= n;
+    }
+    return true;
   }
 
+  ProcessPoolRunner(const ProcessPoolRunner& other);
+  ProcessPoolRunner& operator=(const ProcessPoolRunner& rhs);
+
 private:
-  std::clock_t startTime_;
-  int          failureCount_;
+  const std::vector<Test*>&   tests_;
+  std::size_t                 testsPerProcess_;
+  std::vector<Worker>         workers_;
+  std::vector<ResultRecorder> recorders_;
+  std::vector<bool>           done_;
 };
 
+#endif // CPPUT_HAS_FORK
+
 // ----------------------------------------------------------------------------
 
-struct Result
+/// Stable 64-bit FNV-1a hash of "group.name". Tests are assigned to shards
+/// by this hash, so adding or removing tests never moves other tests to a
+/// different shard.
+inline uint64_t testHash(const Test& test)
 {
-  Result(const std::string& testClassName,
-         const std::string& testName,
-         ResultWriter& out)
-    : out_(out)
-    , pass_(true)
+  // The FNV offset basis and prime, built from 32-bit halves because C++98
+  // has no 64-bit literals.
+  const uint64_t prime = (static_cast<uint64_t>(0x100) << 32) | 0x1B3;
+  uint64_t hash = (static_cast<uint64_t>(0xCBF29CE4) << 32) | 0x84222325;
+  const char* parts[] = { test.getClassName(), ".", test.getName() };
+  for (std::size_t i = 0; i < 3; ++i)
+    for (const char* c = parts[i]; *c; ++c)
+    {
+      hash ^= static_cast<unsigned char>(*c);
+      hash *= prime;
+    }
+  return hash;
+}
+
+inline bool inShard(const Test& test, std::size_t totalShards, std::size_t shardIndex)
+{
+  return totalShards <= 1 || testHash(test) % totalShards == shardIndex;
+}
+
+/// Returns the tests to run, in registration order.
+inline std::vector<Test*> selectTests(const Options& options)
+{
+  const TestFilter filter(options.filter);
+  const bool filtered = !options.filter.empty();
+  std::string fullName;
+  std::vector<Test*> tests;
+  for (Test* c = Repository::instance().getTests(); c; c = c->next())
   {
-    out_.startTest(testClassName, testName);
+    if (((c->getFlags() & Test::IsBenchmark) != 0) != options.benchmarks)
+      continue;
+    if (filtered)
+    {
+      fullName.assign(c->getClassName()).append(1, '.').append(c->getName());
+      if (!filter.matches(fullName))
+        continue;
+    }
+    if (inShard(*c, options.totalShards, options.shardIndex))
+      tests.push_back(c);
   }
-  
-  ~Result()
+  return tests;
+}
+
+/// Prints the selected tests, one "group.name" per line.
+inline void listTests(std::ostream& out, const Options& options)
+{
+  const std::vector<Test*> tests = selectTests(options);
+  for (std::size_t i = 0; i < tests.size(); ++i)
+    out << tests[i]->getClassName() << '.' << tests[i]->getName() << '\n';
+}
+
+/// Saves the process-wide settings a run changes and restores them when it
+/// goes out of scope, so that a run started from within a test leaves the
+/// enclosing run as it was.
+class RunSettingsGuard
+{
+public:
+  RunSettingsGuard()
+    : timeout_(Watchdog::instance().getDefaultTimeout())
+    , benchmark_(Benchmark::settings())
+    , perfCounters_(PerfProbe::enabled())
   {
-    out_.endTest(pass_);
   }
 
-  template <typename T, typename U>
-  void addFailure(const char* filename,
-                  std::size_t line,
-                  T expected,
-                  U actual)
+  ~RunSettingsGuard()
   {
-    pass_ = false;
-    std::stringstream ss;
-    ss << std::setprecision(20)
-       << "failed comparison, expected " << expected
-       << " got " << actual << "\n";
-    out_.failure(filename, line, ss.str());
+    Watchdog::instance().setDefaultTimeout(timeout_);
+    Benchmark::settings() = benchmark_;
+    PerfProbe::enabled() = perfCounters_;
+    if (!cpus_.empty())
+      cpput::pinToCpus(cpus_);
   }
 
-  void addFailure(const char* filename,
-                  std::size_t line,
-                  const char* message)
+  /// Pins the process to cpus until the guard goes out of scope.
+  bool pinToCpus(const std::vector<int>& cpus)
   {
-    pass_ = false;
-    out_.failure(filename, line, message);
+    cpus_ = allowedCpus();
+    return cpput::pinToCpus(cpus);
   }
 
-  ResultWriter& out_;
-  bool          pass_;
-};
-
-// ----------------------------------------------------------------------------
+private:
+  RunSettingsGuard(const RunSettingsGuard& other);
+  RunSettingsGuard& operator=(const RunSettingsGuard& rhs);
 
-class Repository;
+  unsigned          timeout_;
+  BenchmarkSettings benchmark_;
+  bool              perfCounters_;
+  std::vector<int>  cpus_;
+};
 
-class Test
+inline int runAllTests(ResultWriter& writer, const Options& options)
 {
-  friend class Repository;
+  if (!options.shardStatusFile.empty())
+    std::ofstream status(options.shardStatusFile.c_str(), std::ios::app);
+  if (!options.validShard())
+    return 1;
+  RunSettingsGuard guard;
+  Watchdog::instance().setDefaultTimeout(options.timeout);
+  Benchmark::settings() = options.benchmark;
+  PerfProbe::enabled() = options.perfCounters;
 
-public:
-  Test(const char* className, const char* name);
-  virtual ~Test() {}
+  const std::vector<Test*> tests = selectTests(options);
 
-  void run(ResultWriter& out)
+  // Benchmarks run one at a time in this process to not disturb each other.
+  if (options.benchmarks)
   {
-    Result result(test_unit_class_name_, test_unit_name_, out);
-    try
+    if (!options.benchmarkCpus.empty() && !guard.pinToCpus(options.benchmarkCpus))
     {
-      do_run(result);
+      std::cerr << "Cannot pin benchmarks to the given CPUs\n";
+      return 1;
     }
-    catch (const std::exception& e)
+    const std::vector<std::string> warnings = frequencyWarnings(allowedCpus());
+    for (std::size_t i = 0; i < warnings.size(); ++i)
+      std::cerr << "Warning: " << warnings[i] << ", benchmark timings may vary\n";
+
+    BenchmarkBaseline previous;
+    BenchmarkBaseline current;
+    if (!options.compareBaseline.empty())
     {
-      result.addFailure(__FILE__, __LINE__, std::string("Unexpected exception: ").append(e.what()).c_str());
+      if (!previous.load(options.compareBaseline))
+      {
+        std::cerr << "Cannot read benchmark baseline " << options.compareBaseline << "\n";
+        return 1;
+      }
+      Benchmark::settings().compareTo = &previous;
     }
-    catch (...)
+    if (!options.saveBaseline.empty())
+      Benchmark::settings().record = &current;
+
+    for (std::size_t i = 0; i < tests.size(); ++i)
+      tests[i]->run(writer);
+    BenchmarkFamily::reportAll(writer);
+
+    if (!options.saveBaseline.empty() && !current.save(options.saveBaseline))
     {
-      result.addFailure(__FILE__, __LINE__, "Unspecified exception!");
+      std::cerr << "Cannot write benchmark baseline " << options.saveBaseline << "\n";
+      return writer.getNumberOfFailures() + 1;
     }
+    return writer.getNumberOfFailures();
   }
-  
-  Test* next() { return test_unit_next_; }
 
-private:
-  virtual void do_run(Result& testResult_) = 0;
+#ifdef CPPUT_HAS_FORK
+  if (options.processes > 0 && !tests.empty())
+  {
+    ProcessPoolRunner runner(tests, std::min(options.processes, tests.size()), options.testsPerProcess);
+    return runner.run(writer);
+  }
+#endif
+#ifdef CPPUT_HAS_THREADS
+  if (options.jobs > 1 && tests.size() > 1)
+  {
+    ParallelRunner runner(tests, std::min(options.jobs, tests.size()));
+    return runner.run(writer);
+  }
+#else
+  (void)options;
+#endif
 
-private:
-  std::string test_unit_class_name_;
-  std::string test_unit_name_;
-  Test*       test_unit_next_;
-};
+  for (std::size_t i = 0; i < tests.size(); ++i)
+    tests[i]->run(writer);
+  return writer.getNumberOfFailures();
+}
 
-// ----------------------------------------------------------------------------
+inline int runAllTests(ResultWriter& writer)
+{
+  return runAllTests(writer, Options());
+}
 
-class Repository
+/// Parses the command line, picks the result writer and runs all tests.
+inline int runMain(int argc, char* argv[])
 {
-public:
-  static Repository& instance()
+  Options options;
+  if (!options.parse(argc, argv))
+    return 1;
+  if (options.listTests)
   {
-    static Repository repo;
-    return repo;
+    listTests(std::cout, options);
+    return 0;
   }
-  
-  void add(Test* tc)
+  if (options.xml)
   {
-    if (!tests_)
-    {
-      tests_ = tc;
-      return;
-    }
+    XmlResultWriter writer;
+    return runAllTests(writer, options);
+  }
+  TextResultWriter writer;
+  writer.setSlowestReport(options.slowest);
+  return runAllTests(writer, options);
+}
+
+} // namespace cpput
+
+// ----------------------------------------------------------------------------
+// Allocation Counting
+// ----------------------------------------------------------------------------
+
+#if defined(CPPUT_COUNT_ALLOCATIONS) && !defined(CPPUT_ALLOCATIONS_COUNTED)
+#define CPPUT_ALLOCATIONS_COUNTED 1
+
+// Replaces the global operator new and delete to count the allocations of
+// benchmarks. Define CPPUT_COUNT_ALLOCATIONS in exactly one translation unit
+// of the program, e.g. the one with CPPUT_TEST_MAIN.
+
+#if __cplusplus >= 201103L
+#define CPPUT_THROW_BAD_ALLOC
+#define CPPUT_NO_THROW noexcept
+#else
+#define CPPUT_THROW_BAD_ALLOC throw(std::bad_alloc)
+#define CPPUT_NO_THROW throw()
+#endif
+
+namespace cpput
+{
 
-    // add as last
-    Test* tmp = tests_;
-    while (tmp->test_unit_next_)
-      tmp = tmp->test_unit_next_;
-    tmp->test_unit_next_ = tc;
+inline void* countedAllocation(std::size_t size)
+{
+  AllocationCounter::count(size);
+  if (BenchmarkArena* arena = BenchmarkArena::current())
+    if (void* p = arena->allocate(size))
+      return p;
+  if (size == 0)
+    size = 1;
+  for (;;)
+  {
+    if (void* p = std::malloc(size))
+      return p;
+    const std::new_handler handler = std::set_new_handler(0);
+    std::set_new_handler(handler);
+    if (!handler)
+      throw std::bad_alloc();
+    handler();
   }
-  
-  Test* getTests() { return tests_; }
+}
 
-private:
-  Repository() : tests_(0) {}
-  Repository(const Repository& other);
-  Repository& operator=(const Repository& rhs) const;
+static const bool allocationCounterInstalled = (AllocationCounter::installed() = true);
 
-private:
-  Test* tests_;
-};
+} // namespace cpput
 
-inline Test::Test(const char* className, const char* name)
-  : test_unit_class_name_(className)
-  , test_unit_name_(name)
-  , test_unit_next_(0)
+void* operator new(std::size_t size) CPPUT_THROW_BAD_ALLOC
 {
-  Repository::instance().add(this);
+  return ::cpput::countedAllocation(size);
 }
 
-// ----------------------------------------------------------------------------
+void* operator new[](std::size_t size) CPPUT_THROW_BAD_ALLOC
+{
+  return ::cpput::countedAllocation(size);
+}
 
-inline int runAllTests(ResultWriter& writer)
+void* operator new(std::size_t size, const std::nothrow_t&) CPPUT_NO_THROW
 {
-  Test* c = Repository::instance().getTests();
-  while (c)
+  try
   {
-    c->run(writer);
-    c = c->next();
+    return ::cpput::countedAllocation(size);
+  }
+  catch (...)
+  {
+    return 0;
   }
-  return writer.getNumberOfFailures();
 }
 
-} // namespace cpput
+void* operator new[](std::size_t size, const std::nothrow_t&) CPPUT_NO_THROW
+{
+  try
+  {
+    return ::cpput::countedAllocation(size);
+  }
+  catch (...)
+  {
+    return 0;
+  }
+}
+
+void operator delete(void* p) CPPUT_NO_THROW
+{
+  if (!::cpput::BenchmarkArena::owns(p))
+    std::free(p);
+}
+
+void operator delete[](void* p) CPPUT_NO_THROW
+{
+  if (!::cpput::BenchmarkArena::owns(p))
+    std::free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) CPPUT_NO_THROW
+{
+  if (!::cpput::BenchmarkArena::owns(p))
+    std::free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) CPPUT_NO_THROW
+{
+  if (!::cpput::BenchmarkArena::owns(p))
+    std::free(p);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void* p, std::size_t) CPPUT_NO_THROW
+{
+  if (!::cpput::BenchmarkArena::owns(p))
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) CPPUT_NO_THROW
+{
+  if (!::cpput::BenchmarkArena::owns(p))
+    std::free(p);
+}
+#endif
+
+#endif
 
 // Convenience macro to get main function.
 #define CPPUT_TEST_MAIN                               \
 int main(int argc, char* argv[]) {                    \
-  if (argc == 2 && std::string(argv[1]) == "--xml") { \
-    ::cpput::XmlResultWriter writer;                  \
-    return ::cpput::runAllTests(writer);              \
-  }                                                   \
-  ::cpput::TextResultWriter writer;                   \
-  return ::cpput::runAllTests(writer);                \
+  return ::cpput::runMain(argc, argv);                \
 }
 
 // ----------------------------------------------------------------------------
 // Test Macros
 // ----------------------------------------------------------------------------
 
-/// Stand-alone test case.
-///
-#define TEST(group,name) \
+#if defined(CPPUT_SECTION_REGISTRATION) && defined(CPPUT_HAS_SECTION_REGISTRATION)
+
+// The explicit alignment keeps the compiler from padding descriptors, which
+// the runner iterates as one contiguous array.
+#define CPPUT_TEST_DESCRIPTOR_(group,name,flags,timeout) \
+static const ::cpput::TestDescriptor group##name##Descriptor \
+  __attribute__((section("cpput_tests"), used, aligned(sizeof(void*)))) = \
+  { #group, #name, __FILE__, __LINE__, &group##name##Run, flags, timeout }
+
+#define CPPUT_TEST_(group,name,flags,timeout) \
+static void group##name##Run(::cpput::Result& testResult_); \
+CPPUT_TEST_DESCRIPTOR_(group,name,flags,timeout); \
+static void group##name##Run(::cpput::Result& testResult_)
+
+#define CPPUT_TEST_F_(group,name,flags,timeout) \
+class group##name##FixtureTest : public group { \
+public: \
+    void do_run(::cpput::Result& testResult_); \
+}; \
+static void group##name##Run(::cpput::Result& testResult_) { \
+  group##name##FixtureTest test; \
+  test.do_run(testResult_); \
+} \
+CPPUT_TEST_DESCRIPTOR_(group,name,flags,timeout); \
+inline void group##name##FixtureTest::do_run(::cpput::Result& testResult_)
+
+#else
+
+#define CPPUT_TEST_(group,name,flags,timeout) \
 class group##name##Test : public ::cpput::Test  \
 { \
 public: \
-  group##name##Test() : ::cpput::Test(#group,#name) {}    \
+  group##name##Test() : ::cpput::Test(staticNames,#group,#name,__FILE__,__LINE__,flags,timeout) {}    \
   virtual ~group##name##Test() {} \
 private: \
   virtual void do_run(::cpput::Result& testResult_);    \
 } group##name##TestInstance; \
 inline void group##name##Test::do_run(::cpput::Result& testResult_)
 
-/// Test case with fixture.
-///
-#define TEST_F(group,name) \
+#define CPPUT_TEST_F_(group,name,flags,timeout) \
 class group##name##FixtureTest : public group { \
 public: \
     void do_run(::cpput::Result& testResult_); \
 }; \
 class group##name##Test : public ::cpput::Test { \
 public: \
-    group##name##Test() : Test(#group,#name) {} \
+    group##name##Test() : Test(staticNames,#group,#name,__FILE__,__LINE__,flags,timeout) {} \
     virtual void do_run(::cpput::Result& testResult_); \
 } group##name##TestInstance; \
 inline void group##name##Test::do_run(::cpput::Result& testResult_) { \
@@ -405,6 +5381,137 @@ inline void group##name##Test::do_run(::cpput::Result& testResult_) { \
 } \
 inline void group##name##FixtureTest::do_run(::cpput::Result& testResult_)
 
+#endif
+
+/// Stand-alone test case.
+///
+#define TEST(group,name) CPPUT_TEST_(group,name,0,0)
+
+/// Test case with fixture.
+///
+#define TEST_F(group,name) CPPUT_TEST_F_(group,name,0,0)
+
+/// Test cases that never run concurrently with other tests, e.g. because
+/// they modify global state.
+///
+#define TEST_SERIAL(group,name) CPPUT_TEST_(group,name,::cpput::Test::Serial,0)
+#define TEST_F_SERIAL(group,name) CPPUT_TEST_F_(group,name,::cpput::Test::Serial,0)
+
+/// Test cases that fail when running longer than the given number of
+/// milliseconds, overriding the --timeout of the run.
+///
+#define TEST_TIMEOUT(group,name,milliseconds) CPPUT_TEST_(group,name,0,milliseconds)
+#define TEST_F_TIMEOUT(group,name,milliseconds) CPPUT_TEST_F_(group,name,0,milliseconds)
+
+/// Benchmark. The body loops while state.keepRunning() and may use the
+/// assertion macros.
+///
+#define BENCHMARK(group,name) \
+class group##name##Benchmark : public ::cpput::Benchmark \
+{ \
+public: \
+  group##name##Benchmark() : ::cpput::Benchmark(#group,#name,__FILE__,__LINE__) {} \
+private: \
+  virtual void do_benchmark(::cpput::Result& testResult_, ::cpput::BenchmarkState& state); \
+} group##name##BenchmarkInstance; \
+inline void group##name##Benchmark::do_benchmark(::cpput::Result& testResult_, ::cpput::BenchmarkState& state)
+
+/// Benchmark with fixture, which derives from cpput::BenchmarkFixture. The
+/// body uses the fixture's members and may call state.pauseTiming() and
+/// state.resumeTiming() around the setup of each iteration.
+///
+#define BENCHMARK_F(fixture,name) \
+class fixture##name##FixtureBenchmark : public fixture \
+{ \
+public: \
+  void do_benchmark(::cpput::Result& testResult_, ::cpput::BenchmarkState& state); \
+}; \
+class fixture##name##Benchmark : public ::cpput::Benchmark \
+{ \
+public: \
+  fixture##name##Benchmark() : ::cpput::Benchmark(#fixture,#name,__FILE__,__LINE__) {} \
+private: \
+  virtual void do_benchmark(::cpput::Result& testResult_, ::cpput::BenchmarkState& state) \
+  { \
+    fixture##name##FixtureBenchmark body; \
+    body.setUp(state); \
+    body.do_benchmark(testResult_, state); \
+    body.tearDown(state); \
+  } \
+} fixture##name##BenchmarkInstance; \
+inline void fixture##name##FixtureBenchmark::do_benchmark(::cpput::Result& testResult_, ::cpput::BenchmarkState& state)
+
+/// Interleaved comparison of the benchmarks baseline and candidate of group,
+/// reported as "<baseline>_vs_<candidate>" with the speedup of the
+/// candidate, its confidence interval and the p-value of the difference.
+///
+#define BENCHMARK_COMPARE(group,baseline,candidate) \
+static ::cpput::BenchmarkComparison group##baseline##candidate##Comparison(#group,#baseline,#candidate,#baseline "_vs_" #candidate,__FILE__,__LINE__)
+
+/// Benchmark measured twice: as usual with warm caches, and with the caches
+/// evicted before every iteration. The body registers the memory it works
+/// on with state.addColdRegion() so that only those lines are flushed.
+///
+#define BENCHMARK_COLD(group,name) \
+class group##name##Benchmark : public ::cpput::Benchmark \
+{ \
+public: \
+  group##name##Benchmark() : ::cpput::Benchmark(#group,#name,__FILE__,__LINE__) { cold_ = true; } \
+private: \
+  virtual void do_benchmark(::cpput::Result& testResult_, ::cpput::BenchmarkState& state); \
+} group##name##BenchmarkInstance; \
+inline void group##name##Benchmark::do_benchmark(::cpput::Result& testResult_, ::cpput::BenchmarkState& state)
+
+/// Benchmark that records the latency of every iteration into a histogram
+/// and reports its percentiles. For loops issuing requests at a fixed
+/// rate, state.setExpectedInterval() corrects for coordinated omission.
+///
+#define BENCHMARK_LATENCY(group,name) \
+class group##name##Benchmark : public ::cpput::Benchmark \
+{ \
+public: \
+  group##name##Benchmark() : ::cpput::Benchmark(#group,#name,__FILE__,__LINE__) { latency_ = true; } \
+private: \
+  virtual void do_benchmark(::cpput::Result& testResult_, ::cpput::BenchmarkState& state); \
+} group##name##BenchmarkInstance; \
+inline void group##name##Benchmark::do_benchmark(::cpput::Result& testResult_, ::cpput::BenchmarkState& state)
+
+/// Benchmark run on 1, 2, 4, ... maxThreads threads at once, or up to the
+/// number of CPUs if maxThreads is 0. The threads are pinned to CPUs and
+/// start together; state.threadIndex() tells them apart. The throughput at
+/// each thread count is reported after the run.
+///
+#define BENCHMARK_THREADS(group,name,maxThreads) \
+static void group##name##ThreadedBenchmark(::cpput::Result& testResult_, ::cpput::BenchmarkState& state); \
+static ::cpput::BenchmarkFamily group##name##BenchmarkFamily(#group,#name,__FILE__,__LINE__,maxThreads,&group##name##ThreadedBenchmark); \
+static void group##name##ThreadedBenchmark(::cpput::Result& testResult_, ::cpput::BenchmarkState& state)
+
+/// Benchmark run three times with the allocations of its loop served by
+/// malloc, by a bump arena and by a bump arena on transparent huge pages,
+/// which shows whether the loop is bound by allocation or by TLB misses. The
+/// arenas are reset after every turn of the loop, so memory allocated in the
+/// loop must not be used in later iterations. Needs CPPUT_COUNT_ALLOCATIONS.
+///
+#define BENCHMARK_ALLOCATORS(group,name) \
+static void group##name##AllocatorBenchmark(::cpput::Result& testResult_, ::cpput::BenchmarkState& state); \
+static ::cpput::BenchmarkFamily group##name##BenchmarkFamily(#group,#name,__FILE__,__LINE__,&group##name##AllocatorBenchmark); \
+static void group##name##AllocatorBenchmark(::cpput::Result& testResult_, ::cpput::BenchmarkState& state)
+
+/// Benchmark run for every size in a geometric range from first to last
+/// with a multiplier of 8; state.range() is the current size. The fitted
+/// complexity is reported after the run.
+///
+#define BENCHMARK_RANGE(group,name,first,last) \
+  BENCHMARK_RANGE_BOUND(group,name,first,last,::cpput::OAny)
+
+/// Range benchmark that fails when the fitted complexity grows faster than
+/// bound, one of cpput::O1, OLogN, ON, ONLogN or ON2.
+///
+#define BENCHMARK_RANGE_BOUND(group,name,first,last,bound) \
+static void group##name##RangeBenchmark(::cpput::Result& testResult_, ::cpput::BenchmarkState& state); \
+static ::cpput::BenchmarkFamily group##name##BenchmarkFamily(#group,#name,__FILE__,__LINE__,first,last,bound,&group##name##RangeBenchmark); \
+static void group##name##RangeBenchmark(::cpput::Result& testResult_, ::cpput::BenchmarkState& state)
+
 // ----------------------------------------------------------------------------
 // Assertion Macros
 // ----------------------------------------------------------------------------
@@ -458,4 +5565,25 @@ inline void group##name##FixtureTest::do_run(::cpput::Result& testResult_)
   } \
 }
 
+/// Fails if counter, e.g. CacheMisses, of a cpput::PerfCounters was measured
+/// and is not below limit. Counters that are not available pass, so the
+/// assertion holds on machines without hardware counters.
+#define ASSERT_COUNTER_LT(counters,counter,limit) \
+{ \
+  const ::cpput::PerfCounters& countersTmp = counters; \
+  if (countersTmp.has(::cpput::PerfCounters::counter) && \
+      !(countersTmp.get(::cpput::PerfCounters::counter) < (limit))) \
+  { \
+    testResult_.addFailure(__FILE__, __LINE__, #counter " < " #limit, countersTmp.get(::cpput::PerfCounters::counter)); \
+    return; \
+  } \
+}
+
+/// Declares the bytes a test processed, reported as bytes per second of its
+/// wall time. Benchmarks use state.setBytesProcessed() instead.
+#define SET_BYTES_PROCESSED(bytes) testResult_.bytesProcessed_ = static_cast<double>(bytes)
+
+/// Declares the items a test processed, reported as items per second.
+#define SET_ITEMS_PROCESSED(items) testResult_.itemsProcessed_ = static_cast<double>(items)
+
 #endif // CPPUT_TESTHARNESS_HPP
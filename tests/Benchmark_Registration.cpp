@@ -0,0 +1,78 @@
+// Measures the static-initialization cost of registering very large suites.
+//
+// Usage: registration_benchmark [count...]   (default: 10000 100000 1000000)
+
+#include "../TestHarness.hpp"
+#include <cstdlib>
+#include <cstdio>
+
+namespace
+{
+
+class SyntheticTest : public cpput::Test
+{
+public:
+  SyntheticTest(const char* className, const char* name)
+    : cpput::Test(className, name)
+  {
+  }
+
+private:
+  virtual void do_run(cpput::Result&) {}
+};
+
+double seconds(std::clock_t start)
+{
+  return static_cast<double>(std::clock() - start) / CLOCKS_PER_SEC;
+}
+
+void measure(std::size_t count)
+{
+  static std::size_t first = 0;
+  std::vector<std::string> names;
+  names.reserve(2 * count);
+  for (std::size_t i = 0; i < count; ++i)
+  {
+    std::ostringstream group;
+    std::ostringstream name;
+    group << "g" << (first + i) / 100;
+    name << "t" << first + i;
+    names.push_back(group.str());
+    names.push_back(name.str());
+  }
+  first += count;
+
+  std::clock_t start = std::clock();
+  for (std::size_t i = 0; i < count; ++i)
+    new SyntheticTest(names[2 * i].c_str(), names[2 * i + 1].c_str());
+  const double registration = seconds(start);
+
+  cpput::Repository& repo = cpput::Repository::instance();
+  start = std::clock();
+  std::size_t found = 0;
+  for (std::size_t i = 0; i < count; ++i)
+    found += repo.find(names[2 * i], names[2 * i + 1]) != 0;
+  const double lookup = seconds(start);
+
+  std::printf("%9lu tests: register %8.3f s (%6.1f ns/test), index+find %8.3f s (%6.1f ns/test)%s\n",
+              static_cast<unsigned long>(count),
+              registration, registration * 1e9 / count,
+              lookup, lookup * 1e9 / count,
+              found == count ? "" : "  LOOKUP MISMATCH");
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  if (argc < 2)
+  {
+    measure(10000);
+    measure(100000);
+    measure(1000000);
+    return 0;
+  }
+  for (int i = 1; i < argc; ++i)
+    measure(std::strtoul(argv[i], 0, 10));
+  return 0;
+}
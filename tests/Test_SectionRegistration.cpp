@@ -0,0 +1,41 @@
+#define CPPUT_SECTION_REGISTRATION
+#include "../TestHarness.hpp"
+#include <string>
+
+#ifdef CPPUT_HAS_SECTION_REGISTRATION
+
+// ----------------------------------------------------------------------------
+// Section registration
+
+namespace
+{
+
+struct Answer
+{
+  Answer() : value_(42) {}
+  int value_;
+};
+
+} // namespace
+
+const std::size_t standAloneTestLine = __LINE__ + 1;
+TEST(SectionRegistration, runs_stand_alone_test)
+{
+  ASSERT_EQ(4, 2 + 2);
+}
+
+TEST_F(Answer, section_registered_fixture_is_constructed)
+{
+  ASSERT_EQ(42, value_);
+}
+
+TEST(SectionRegistration, tests_are_available_through_repository)
+{
+  cpput::Test* test = cpput::Repository::instance().find("SectionRegistration", "runs_stand_alone_test");
+  ASSERT_TRUE(test != 0);
+  ASSERT_STREQ(__FILE__, test->getFile());
+  ASSERT_EQ(standAloneTestLine, test->getLine());
+  ASSERT_TRUE(cpput::Repository::instance().find("Answer", "section_registered_fixture_is_constructed") != 0);
+}
+
+#endif
@@ -1,4 +1,5 @@
 #include "../TestHarness.hpp"
+#include <cstdio>
 #include <string>
 #include <math.h>
 
@@ -120,8 +121,1969 @@ TEST(TextResultWriter, end_test_with_failure_does_not_increment_failures)
   ASSERT_EQ(0, writer.getNumberOfFailures());
 }
 
+TEST_SERIAL(TextResultWriter, restores_console_formatting_after_reports)
+{
+  std::ostringstream out;
+  std::streambuf* console = std::cout.rdbuf(out.rdbuf());
+  const std::ios::fmtflags flags = std::cout.flags();
+  const std::streamsize precision = std::cout.precision();
+  {
+    cpput::TextResultWriter writer;
+    cpput::BenchmarkResult benchmark;
+    benchmark.allocationsCounted = true;
+    benchmark.unreliable = true;
+    writer.benchmark(benchmark);
+    writer.complexity(cpput::ComplexityResult());
+    writer.comparison(cpput::ComparisonResult());
+    cpput::ScalingResult scaling;
+    scaling.points.push_back(cpput::ScalingPoint());
+    writer.scaling(scaling);
+    cpput::AllocatorsResult allocators;
+    allocators.allocators.push_back(cpput::MallocAllocator);
+    allocators.allocators.push_back(cpput::ArenaAllocator);
+    allocators.times.push_back(1);
+    allocators.times.push_back(1);
+    writer.allocators(allocators);
+  }
+  const bool restored = std::cout.flags() == flags && std::cout.precision() == precision;
+  std::cout.rdbuf(console);
+  ASSERT_TRUE(restored);
+}
+
 TEST(XmlResultWriter, initial_number_of_failures_are_zero)
 {
   cpput::XmlResultWriter writer;
   ASSERT_EQ(0, writer.getNumberOfFailures());
 }
+
+TEST_SERIAL(XmlResultWriter, collects_properties_into_one_element)
+{
+  std::ostringstream out;
+  std::streambuf* console = std::cout.rdbuf(out.rdbuf());
+  {
+    cpput::XmlResultWriter writer;
+    writer.startTest("group", "name");
+    cpput::ComplexityResult complexity;
+    writer.complexity(complexity);
+    cpput::TestMetrics metrics;
+    metrics.wallTime = 1;
+    metrics.bytesProcessed = 64;
+    writer.metrics(metrics);
+    writer.endTest(true);
+  }
+  std::cout.rdbuf(console);
+
+  const std::string xml = out.str();
+  const std::string::size_type first = xml.find("<properties>");
+  ASSERT_TRUE(first != std::string::npos);
+  ASSERT_TRUE(xml.find("<properties>", first + 1) == std::string::npos);
+  const std::string::size_type last = xml.find("</properties>");
+  ASSERT_TRUE(xml.find("\"complexity\"") < last);
+  ASSERT_TRUE(xml.find("\"bytes_per_second\"") < last);
+}
+
+// ----------------------------------------------------------------------------
+// Repository
+
+TEST(Repository, finds_registered_test_by_group_and_name)
+{
+  cpput::Test* test = cpput::Repository::instance().find("macro_ASSERT_EQ", "equality_of_simple_types");
+  ASSERT_TRUE(test != 0);
+  ASSERT_EQ(std::string("macro_ASSERT_EQ"), test->getClassName());
+  ASSERT_EQ(std::string("equality_of_simple_types"), test->getName());
+}
+
+TEST(Repository, find_returns_null_for_unknown_test)
+{
+  ASSERT_TRUE(cpput::Repository::instance().find("macro_ASSERT_EQ", "no_such_test") == 0);
+  ASSERT_TRUE(cpput::Repository::instance().find("no_such_group", "equality_of_simple_types") == 0);
+}
+
+TEST(Repository, finds_group_in_registration_order)
+{
+  const cpput::Repository::TestList& group = cpput::Repository::instance().findGroup("macro_ASSERT_EQ");
+  ASSERT_EQ(2u, group.size());
+  ASSERT_EQ(std::string("equality_of_simple_types"), group[0]->getName());
+  ASSERT_EQ(std::string("string_objects_test_out_equal"), group[1]->getName());
+}
+
+namespace
+{
+
+class HandWrittenTest : public cpput::Test
+{
+public:
+  explicit HandWrittenTest(const std::string& name)
+    : cpput::Test("HandWritten", name.c_str())
+  {
+  }
+
+private:
+  virtual void do_run(cpput::Result&) {}
+};
+
+HandWrittenTest handWrittenTest(std::string("name_built_") + "from_a_temporary_string");
+
+} // namespace
+
+TEST(Repository, keeps_copies_of_names_passed_to_test_constructor)
+{
+  cpput::Test* test = cpput::Repository::instance().find("HandWritten", "name_built_from_a_temporary_string");
+  ASSERT_TRUE(test == &handWrittenTest);
+  ASSERT_EQ(std::string("HandWritten"), test->getClassName());
+  ASSERT_EQ(std::string("name_built_from_a_temporary_string"), test->getName());
+  ASSERT_EQ(std::string(""), test->getFile());
+}
+
+TEST(Repository, size_counts_all_registered_tests)
+{
+  std::size_t count = 0;
+  for (cpput::Test* t = cpput::Repository::instance().getTests(); t; t = t->next())
+    count++;
+  ASSERT_EQ(count, cpput::Repository::instance().size());
+}
+
+// ----------------------------------------------------------------------------
+// Options
+
+TEST(Options, parses_xml_and_jobs)
+{
+  char program[] = "unittests";
+  char xml[] = "--xml";
+  char jobs[] = "--jobs=4";
+  char* argv[] = { program, xml, jobs };
+  cpput::Options options;
+  ASSERT_TRUE(options.parse(3, argv));
+  ASSERT_TRUE(options.xml);
+  ASSERT_EQ(4u, options.jobs);
+}
+
+TEST(Options, rejects_unknown_option)
+{
+  char program[] = "unittests";
+  char unknown[] = "--no-such-option";
+  char* argv[] = { program, unknown };
+  cpput::Options options;
+  ASSERT_FALSE(options.parse(2, argv));
+}
+
+// ----------------------------------------------------------------------------
+// Parallel runner
+
+namespace
+{
+
+struct NameRecordingWriter : public cpput::ResultWriter
+{
+  NameRecordingWriter() : failures_(0) {}
+
+  virtual void startTest(const std::string& className, const std::string& name)
+  {
+    names_.push_back(className + "." + name);
+  }
+  virtual void endTest(bool) {}
+  virtual void failure(const std::string&, std::size_t, const std::string&) { failures_++; }
+  virtual int getNumberOfFailures() const { return failures_; }
+
+  std::vector<std::string> names_;
+  int                      failures_;
+};
+
+} // namespace
+
+TEST(ResultRecorder, replays_test_and_failures)
+{
+  cpput::ResultRecorder recorder;
+  recorder.startTest("group", "name");
+  recorder.failure("file.cpp", 12, "message");
+  recorder.endTest(false);
+
+  NameRecordingWriter writer;
+  recorder.replay(writer);
+  ASSERT_EQ(1u, writer.names_.size());
+  ASSERT_EQ(std::string("group.name"), writer.names_[0]);
+  ASSERT_EQ(1, writer.getNumberOfFailures());
+}
+
+#ifdef CPPUT_HAS_THREADS
+
+TEST_SERIAL(ParallelRunner, reports_results_in_registration_order)
+{
+  std::vector<cpput::Test*> tests;
+  for (cpput::Test* t = cpput::Repository::instance().getTests(); t; t = t->next())
+    if (std::string(t->getClassName()).compare(0, 6, "macro_") == 0)
+      tests.push_back(t);
+
+  NameRecordingWriter writer;
+  cpput::ParallelRunner runner(tests, 3);
+  ASSERT_EQ(0, runner.run(writer));
+  ASSERT_EQ(tests.size(), writer.names_.size());
+  for (std::size_t i = 0; i < tests.size(); ++i)
+    ASSERT_EQ(std::string(tests[i]->getClassName()) + "." + tests[i]->getName(), writer.names_[i]);
+}
+
+#endif
+
+TEST(ResultRecorder, encoded_recording_decodes_to_same_results)
+{
+  cpput::ResultRecorder recorder;
+  recorder.startTest("group", "name");
+  recorder.failure("file.cpp", 12, "message");
+  recorder.endTest(false);
+  std::string data;
+  recorder.encode(data);
+
+  cpput::ResultRecorder decoded;
+  ASSERT_TRUE(decoded.decode(data));
+  ASSERT_FALSE(decoded.decode(data.substr(0, data.size() - 1)));
+  ASSERT_TRUE(decoded.decode(data));
+  NameRecordingWriter writer;
+  decoded.replay(writer);
+  ASSERT_EQ(std::string("group.name"), writer.names_[0]);
+  ASSERT_EQ(1, writer.getNumberOfFailures());
+}
+
+// ----------------------------------------------------------------------------
+// Process pool runner
+
+#ifdef CPPUT_HAS_FORK
+
+namespace
+{
+
+bool crashOnPurpose = false;
+
+} // namespace
+
+TEST(ProcessPoolRunnerSubject, crashes_when_asked_to)
+{
+  if (crashOnPurpose)
+    std::abort();
+  ASSERT_FALSE(crashOnPurpose);
+}
+
+TEST(ProcessPoolRunnerSubject, passes_after_crash)
+{
+  ASSERT_TRUE(true);
+}
+
+TEST_SERIAL(ProcessPoolRunner, reports_crashing_test_and_continues)
+{
+  const cpput::Repository::TestList& group = cpput::Repository::instance().findGroup("ProcessPoolRunnerSubject");
+  std::vector<cpput::Test*> tests(group.begin(), group.end());
+  tests.insert(tests.end(), group.begin(), group.end());
+
+  NameRecordingWriter writer;
+  crashOnPurpose = true;
+  cpput::ProcessPoolRunner runner(tests, 2);
+  const int failures = runner.run(writer);
+  crashOnPurpose = false;
+
+  ASSERT_EQ(2, failures);
+  ASSERT_EQ(4u, writer.names_.size());
+  ASSERT_EQ(std::string("ProcessPoolRunnerSubject.passes_after_crash"), writer.names_[3]);
+}
+
+namespace
+{
+
+int corruptResultsFd = -1;
+
+} // namespace
+
+TEST(ProcessPoolRunnerCorruptSubject, sends_corrupt_result_when_asked_to)
+{
+  if (corruptResultsFd < 0)
+    return;
+  // A frame too short to hold a recording, ahead of the real result.
+  char frame[sizeof(std::size_t) + 1] = { 0 };
+  const std::size_t size = 1;
+  std::memcpy(frame, &size, sizeof(size));
+  ASSERT_TRUE(write(corruptResultsFd, frame, sizeof(frame)) == static_cast<ssize_t>(sizeof(frame)));
+}
+
+TEST_SERIAL(ProcessPoolRunner, reports_corrupt_result_as_failure)
+{
+  std::vector<cpput::Test*> tests;
+  tests.push_back(cpput::Repository::instance().find("ProcessPoolRunnerCorruptSubject", "sends_corrupt_result_when_asked_to"));
+  tests.push_back(cpput::Repository::instance().find("ProcessPoolRunnerSubject", "passes_after_crash"));
+
+  // The worker's pipes get the lowest free descriptors, like these.
+  int commands[2];
+  int results[2];
+  ASSERT_EQ(0, pipe(commands));
+  ASSERT_EQ(0, pipe(results));
+  close(commands[0]);
+  close(commands[1]);
+  close(results[0]);
+  close(results[1]);
+
+  NameRecordingWriter writer;
+  corruptResultsFd = results[1];
+  cpput::ProcessPoolRunner runner(tests, 1);
+  const int failures = runner.run(writer);
+  corruptResultsFd = -1;
+
+  ASSERT_EQ(1, failures);
+  ASSERT_EQ(2u, writer.names_.size());
+  ASSERT_EQ(std::string("ProcessPoolRunnerCorruptSubject.sends_corrupt_result_when_asked_to"), writer.names_[0]);
+}
+
+namespace
+{
+
+int forkedRuns = 0;
+
+} // namespace
+
+TEST(ProcessPoolRunnerForkSubject, sees_pristine_global_state)
+{
+  forkedRuns++;
+  ASSERT_EQ(1, forkedRuns);
+}
+
+TEST_SERIAL(ProcessPoolRunner, runs_each_test_in_fresh_fork_when_limited_to_one)
+{
+  const cpput::Repository::TestList& group = cpput::Repository::instance().findGroup("ProcessPoolRunnerForkSubject");
+  std::vector<cpput::Test*> tests(3, group.front());
+
+  NameRecordingWriter writer;
+  forkedRuns = 0;
+  cpput::ProcessPoolRunner runner(tests, 1, 1);
+  ASSERT_EQ(0, runner.run(writer));
+  ASSERT_EQ(3u, writer.names_.size());
+}
+
+TEST_SERIAL(ProcessPoolRunner, reuses_workers_without_limit)
+{
+  const cpput::Repository::TestList& group = cpput::Repository::instance().findGroup("ProcessPoolRunnerForkSubject");
+  std::vector<cpput::Test*> tests(3, group.front());
+
+  NameRecordingWriter writer;
+  forkedRuns = 0;
+  cpput::ProcessPoolRunner runner(tests, 1);
+  ASSERT_EQ(2, runner.run(writer));
+}
+
+namespace
+{
+
+bool hangOnPurpose = false;
+
+} // namespace
+
+TEST_TIMEOUT(WatchdogSubject, hangs_when_asked_to, 100)
+{
+  while (hangOnPurpose)
+    usleep(1000);
+  ASSERT_FALSE(hangOnPurpose);
+}
+
+TEST(WatchdogSubject, passes_after_hang)
+{
+  ASSERT_TRUE(true);
+}
+
+TEST_SERIAL(Watchdog, terminates_hung_test_in_worker_and_continues)
+{
+  const cpput::Repository::TestList& group = cpput::Repository::instance().findGroup("WatchdogSubject");
+  std::vector<cpput::Test*> tests(group.begin(), group.end());
+
+  NameRecordingWriter writer;
+  hangOnPurpose = true;
+  cpput::ProcessPoolRunner runner(tests, 1);
+  const int failures = runner.run(writer);
+  hangOnPurpose = false;
+
+  ASSERT_EQ(1, failures);
+  ASSERT_EQ(2u, writer.names_.size());
+}
+
+TEST(Watchdog, test_timeout_is_recorded)
+{
+  cpput::Test* test = cpput::Repository::instance().find("WatchdogSubject", "hangs_when_asked_to");
+  ASSERT_TRUE(test != 0);
+  ASSERT_EQ(100u, test->getTimeout());
+}
+
+#endif
+
+// ----------------------------------------------------------------------------
+// Sharding
+
+TEST(Sharding, test_hash_is_stable_fnv1a_of_full_name)
+{
+  cpput::Test* test = cpput::Repository::instance().find("macro_ASSERT_TRUE", "simple_expressions_equal_true");
+  ASSERT_TRUE(test != 0);
+  ASSERT_TRUE(cpput::testHash(*test) == ((static_cast<uint64_t>(0x3317DC1B) << 32) | 0xF7E928D7));
+}
+
+TEST(Sharding, every_test_belongs_to_exactly_one_shard)
+{
+  for (cpput::Test* t = cpput::Repository::instance().getTests(); t; t = t->next())
+  {
+    int shards = 0;
+    for (std::size_t i = 0; i < 3; ++i)
+      shards += cpput::inShard(*t, 3, i);
+    ASSERT_EQ(1, shards);
+  }
+}
+
+TEST(Options, parses_shard_and_rejects_index_out_of_range)
+{
+  char program[] = "unittests";
+  char total[] = "--total-shards=4";
+  char index[] = "--shard-index=3";
+  char badIndex[] = "--shard-index=4";
+  char* argv[] = { program, total, index };
+  cpput::Options options;
+  ASSERT_TRUE(options.parse(3, argv));
+  ASSERT_EQ(4u, options.totalShards);
+  ASSERT_EQ(3u, options.shardIndex);
+
+  argv[2] = badIndex;
+  ASSERT_FALSE(options.parse(3, argv));
+}
+
+// ----------------------------------------------------------------------------
+// Filtering
+
+TEST(GlobPattern, matches_literals_and_wildcards)
+{
+  ASSERT_TRUE(cpput::GlobPattern("Foo.bar").matches("Foo.bar"));
+  ASSERT_FALSE(cpput::GlobPattern("Foo.bar").matches("Foo.bars"));
+  ASSERT_TRUE(cpput::GlobPattern("Foo.*").matches("Foo.bar"));
+  ASSERT_TRUE(cpput::GlobPattern("*.bar").matches("Foo.bar"));
+  ASSERT_TRUE(cpput::GlobPattern("F?o.*r").matches("Foo.bar"));
+  ASSERT_TRUE(cpput::GlobPattern("*o*a*").matches("Foo.bar"));
+  ASSERT_TRUE(cpput::GlobPattern("*").matches(""));
+  ASSERT_FALSE(cpput::GlobPattern("Foo.*bar*baz").matches("Foo.bar"));
+  ASSERT_FALSE(cpput::GlobPattern("ab*ba").matches("aba"));
+}
+
+TEST(TestFilter, selects_positive_and_excludes_negative_patterns)
+{
+  cpput::TestFilter filter("Foo.*:Bar.baz-*.slow_*");
+  ASSERT_TRUE(filter.matches("Foo.fast"));
+  ASSERT_TRUE(filter.matches("Bar.baz"));
+  ASSERT_FALSE(filter.matches("Bar.qux"));
+  ASSERT_FALSE(filter.matches("Foo.slow_test"));
+}
+
+TEST(TestFilter, without_positive_patterns_selects_all_but_negative)
+{
+  cpput::TestFilter filter("-Foo.*");
+  ASSERT_TRUE(filter.matches("Bar.baz"));
+  ASSERT_FALSE(filter.matches("Foo.bar"));
+  ASSERT_TRUE(cpput::TestFilter().matches("Foo.bar"));
+}
+
+#ifdef CPPUT_HAS_REGEX
+
+TEST(TestFilter, matches_whole_name_against_regular_expressions)
+{
+  cpput::TestFilter filter("/Foo\\.(get|set)_[a-z]+/:Bar.*-/.*_[0-9]+/:*.slow");
+  ASSERT_TRUE(filter.valid());
+  ASSERT_TRUE(filter.matches("Foo.get_value"));
+  ASSERT_TRUE(filter.matches("Bar.baz"));
+  ASSERT_FALSE(filter.matches("Foo.get_Value"));
+  ASSERT_FALSE(filter.matches("MyFoo.set_value"));
+  ASSERT_FALSE(filter.matches("Bar.baz_2"));
+  ASSERT_FALSE(filter.matches("Bar.slow"));
+
+  ASSERT_TRUE(cpput::TestFilter("/a:b|c-d/").matches("a:b"));
+  ASSERT_TRUE(cpput::TestFilter("/a\\/b/").matches("a/b"));
+}
+
+TEST(TestFilter, rejects_malformed_regular_expressions)
+{
+  ASSERT_FALSE(cpput::TestFilter("/Foo(/").valid());
+  ASSERT_FALSE(cpput::TestFilter("Foo.*:/Foo").valid());
+  ASSERT_TRUE(cpput::TestFilter("Foo.*-Bar.*").valid());
+
+  char program[] = "unittests";
+  char invalid[] = "--filter=/Foo(/";
+  char* argv[] = { program, invalid };
+  cpput::Options options;
+  ASSERT_FALSE(options.parse(2, argv));
+}
+
+#endif
+
+TEST(Options, lists_tests_matching_filter)
+{
+  cpput::Options options;
+  options.filter = "macro_ASSERT_EQ.*";
+  std::ostringstream out;
+  cpput::listTests(out, options);
+  ASSERT_EQ(std::string("macro_ASSERT_EQ.equality_of_simple_types\n"
+                        "macro_ASSERT_EQ.string_objects_test_out_equal\n"), out.str());
+}
+
+// ----------------------------------------------------------------------------
+// Metrics
+
+namespace
+{
+
+struct MetricsRecordingWriter : public NameRecordingWriter
+{
+  virtual void metrics(const cpput::TestMetrics& m) { metrics_ = m; }
+
+  cpput::TestMetrics metrics_;
+};
+
+} // namespace
+
+#ifdef CPPUT_HAS_THREADS
+
+TEST(Result, reports_wall_time_including_sleep_and_thread_cpu_time)
+{
+  MetricsRecordingWriter writer;
+  {
+    cpput::Result result("group", "name", writer);
+    usleep(20000);
+  }
+  ASSERT_TRUE(writer.metrics_.wallTime >= 0.02);
+  ASSERT_TRUE(writer.metrics_.cpuTime < writer.metrics_.wallTime);
+  ASSERT_TRUE(writer.metrics_.voluntaryContextSwitches >= 1);
+  ASSERT_TRUE(writer.metrics_.maxResidentSetSize > 0);
+}
+
+#endif
+
+TEST(ResultRecorder, keeps_metrics_through_encoding)
+{
+  cpput::TestMetrics metrics;
+  metrics.wallTime = 1.5;
+  metrics.minorPageFaults = 7;
+  cpput::ResultRecorder recorder;
+  recorder.startTest("group", "name");
+  recorder.metrics(metrics);
+  recorder.endTest(true);
+  std::string data;
+  recorder.encode(data);
+
+  cpput::ResultRecorder decoded;
+  ASSERT_TRUE(decoded.decode(data));
+  MetricsRecordingWriter writer;
+  decoded.replay(writer);
+  ASSERT_NEAR(1.5, writer.metrics_.wallTime, 1e-9);
+  ASSERT_EQ(7, writer.metrics_.minorPageFaults);
+}
+
+// ----------------------------------------------------------------------------
+// Timing report
+
+TEST(percentile, uses_nearest_rank)
+{
+  std::vector<double> values;
+  for (int i = 1; i <= 100; ++i)
+    values.push_back(i);
+  ASSERT_NEAR(50.0, cpput::percentile(values, 50), 1e-9);
+  ASSERT_NEAR(90.0, cpput::percentile(values, 90), 1e-9);
+  ASSERT_NEAR(100.0, cpput::percentile(values, 100), 1e-9);
+  ASSERT_NEAR(1.0, cpput::percentile(values, 0), 1e-9);
+  ASSERT_NEAR(0.0, cpput::percentile(std::vector<double>(), 50), 1e-9);
+}
+
+TEST(TimingReport, lists_slowest_tests_and_groups)
+{
+  cpput::TimingReport report;
+  report.add("Fast", "a", 0.001);
+  report.add("Slow", "b", 0.5);
+  report.add("Fast", "c", 0.002);
+  report.add("Slow", "d", 0.25);
+  std::ostringstream out;
+  report.print(out, 1);
+  const std::string text = out.str();
+  ASSERT_TRUE(text.find("Slowest 1 of 4 tests:\n    0.500000 s  Slow.b\n") != std::string::npos);
+  ASSERT_TRUE(text.find("Slowest 1 of 2 groups:\n    0.750000 s  Slow (2 tests)\n") != std::string::npos);
+  ASSERT_TRUE(text.find("p50 0.002000 s, p90 0.500000 s, p99 0.500000 s, total 0.753000 s") != std::string::npos);
+}
+
+// ----------------------------------------------------------------------------
+// Benchmarks
+
+namespace
+{
+
+struct BenchmarkRecordingWriter : public NameRecordingWriter
+{
+  virtual void benchmark(const cpput::BenchmarkResult& result) { results_.push_back(result); }
+
+  std::vector<cpput::BenchmarkResult> results_;
+};
+
+/// Runs benchmarks briefly while in scope and restores the previous
+/// settings when the test leaves it, also through a failed assertion.
+class BenchmarkSettingsGuard
+{
+public:
+  explicit BenchmarkSettingsGuard(std::size_t repetitions)
+    : saved_(cpput::Benchmark::settings())
+  {
+    cpput::Benchmark::settings().minTime = 0.001;
+    cpput::Benchmark::settings().repetitions = repetitions;
+  }
+
+  ~BenchmarkSettingsGuard()
+  {
+    cpput::Benchmark::settings() = saved_;
+  }
+
+private:
+  const cpput::BenchmarkSettings saved_;
+};
+
+} // namespace
+
+BENCHMARK(Benchmark, sum_of_vector)
+{
+  std::vector<int> values(64, 1);
+  while (state.keepRunning())
+  {
+    int sum = 0;
+    for (std::size_t i = 0; i < values.size(); ++i)
+      sum += values[i];
+    cpput::doNotOptimize(sum);
+  }
+  ASSERT_EQ(64u, values.size());
+}
+
+TEST(computeStatistics, summarizes_samples)
+{
+  std::vector<double> samples;
+  samples.push_back(4);
+  samples.push_back(1);
+  samples.push_back(3);
+  samples.push_back(2);
+  const cpput::Statistics stats = cpput::computeStatistics(samples);
+  ASSERT_NEAR(2.5, stats.mean, 1e-9);
+  ASSERT_NEAR(2.5, stats.median, 1e-9);
+  ASSERT_NEAR(1.290994, stats.stddev, 1e-6);
+  ASSERT_NEAR(1.0, stats.min, 1e-9);
+  ASSERT_NEAR(4.0, stats.max, 1e-9);
+}
+
+TEST(formatDuration, picks_largest_unit_above_one)
+{
+  ASSERT_EQ(std::string("12.3 ns"), cpput::formatDuration(12.3e-9));
+  ASSERT_EQ(std::string("1.5 ms"), cpput::formatDuration(0.0015));
+  ASSERT_EQ(std::string("2 s"), cpput::formatDuration(2));
+}
+
+TEST(BenchmarkState, runs_requested_iterations)
+{
+  cpput::BenchmarkState state(10);
+  std::size_t count = 0;
+  while (state.keepRunning())
+    count++;
+  ASSERT_EQ(10u, count);
+  ASSERT_TRUE(state.finished());
+  ASSERT_FALSE(state.keepRunning());
+}
+
+TEST_SERIAL(Benchmark, calibrates_iterations_and_reports_statistics)
+{
+  cpput::Test* benchmark = cpput::Repository::instance().find("Benchmark", "sum_of_vector");
+  ASSERT_TRUE(benchmark != 0);
+  ASSERT_TRUE((benchmark->getFlags() & cpput::Test::IsBenchmark) != 0);
+
+  const BenchmarkSettingsGuard guard(3);
+  BenchmarkRecordingWriter writer;
+  benchmark->run(writer);
+
+  ASSERT_EQ(0, writer.getNumberOfFailures());
+  ASSERT_EQ(1u, writer.results_.size());
+  const cpput::BenchmarkResult& result = writer.results_[0];
+  ASSERT_EQ(3u, result.repetitions);
+  ASSERT_TRUE(result.iterations > 1);
+  ASSERT_TRUE(result.time.min > 0);
+  ASSERT_TRUE(result.time.min <= result.time.median);
+
+  // Only the run that calibrates is bound to the minimum time; later ones
+  // may be faster once nothing else competes for the CPU.
+  double seconds = 0;
+  cpput::Result calibration("Benchmark", "sum_of_vector", writer);
+  const std::size_t iterations = static_cast<cpput::Benchmark*>(benchmark)->calibrate(calibration, seconds);
+  ASSERT_TRUE(iterations > 1);
+  ASSERT_TRUE(seconds >= 0.001);
+}
+
+TEST(Options, parses_benchmark_settings)
+{
+  char program[] = "unittests";
+  char benchmarks[] = "--benchmarks";
+  char minTime[] = "--benchmark-min-time=0.5";
+  char repetitions[] = "--benchmark-repetitions=7";
+  char* argv[] = { program, benchmarks, minTime, repetitions };
+  cpput::Options options;
+  ASSERT_TRUE(options.parse(4, argv));
+  ASSERT_TRUE(options.benchmarks);
+  ASSERT_NEAR(0.5, options.benchmark.minTime, 1e-9);
+  ASSERT_EQ(7u, options.benchmark.repetitions);
+}
+
+TEST(selectTests, keeps_benchmarks_out_of_test_runs)
+{
+  cpput::Options options;
+  options.filter = "Benchmark.sum_of_vector";
+  std::vector<cpput::Test*> tests = cpput::selectTests(options);
+  for (std::size_t i = 0; i < tests.size(); ++i)
+    ASSERT_TRUE((tests[i]->getFlags() & cpput::Test::IsBenchmark) == 0);
+
+  options.benchmarks = true;
+  tests = cpput::selectTests(options);
+  ASSERT_EQ(1u, tests.size());
+  ASSERT_EQ(std::string("sum_of_vector"), tests[0]->getName());
+}
+
+namespace
+{
+
+struct ComplexityRecordingWriter : public BenchmarkRecordingWriter
+{
+  virtual void complexity(const cpput::ComplexityResult& result) { complexities_.push_back(result); }
+
+  std::vector<cpput::ComplexityResult> complexities_;
+};
+
+void quadratic(std::size_t n)
+{
+  for (std::size_t i = 0; i < n; ++i)
+    for (std::size_t j = 0; j < n; ++j)
+      cpput::doNotOptimize(i * j);
+}
+
+} // namespace
+
+BENCHMARK_RANGE(Benchmark, sum_of_range, 8, 4096)
+{
+  std::vector<int> values(state.range(), 1);
+  while (state.keepRunning())
+  {
+    int sum = 0;
+    for (std::size_t i = 0; i < values.size(); ++i)
+      sum += values[i];
+    cpput::doNotOptimize(sum);
+  }
+  ASSERT_EQ(state.range(), values.size());
+}
+
+BENCHMARK_RANGE_BOUND(BenchmarkSubject, quadratic_within_linear_bound, 8, 512, cpput::ON)
+{
+  while (state.keepRunning())
+    quadratic(state.range());
+  ASSERT_TRUE(state.range() >= 8);
+}
+
+TEST(fitComplexity, finds_growth_of_exact_data)
+{
+  std::vector<double> sizes;
+  for (double n = 8; n <= 1 << 20; n *= 8)
+    sizes.push_back(n);
+
+  const cpput::Complexity complexities[] = { cpput::O1, cpput::OLogN, cpput::ON, cpput::ONLogN, cpput::ON2 };
+  for (std::size_t c = 0; c < 5; ++c)
+  {
+    std::vector<double> times;
+    for (std::size_t i = 0; i < sizes.size(); ++i)
+      times.push_back(3e-9 * cpput::complexityValue(complexities[c], sizes[i]));
+    const cpput::ComplexityResult fit = cpput::fitComplexity(sizes, times);
+    ASSERT_EQ(std::string(cpput::complexityName(complexities[c])), std::string(cpput::complexityName(fit.complexity)));
+    ASSERT_NEAR(3e-9, fit.coefficient, 1e-15);
+    ASSERT_NEAR(0.0, fit.rms, 1e-9);
+  }
+}
+
+TEST(fitComplexity, flags_noisy_growth_beyond_declared_bound)
+{
+  std::vector<double> sizes;
+  std::vector<double> times;
+  for (double n = 8; n <= 4096; n *= 8)
+  {
+    sizes.push_back(n);
+    times.push_back(2e-9 * n * n * (sizes.size() % 2 ? 1.05 : 0.95));
+  }
+  cpput::ComplexityResult fit = cpput::fitComplexity(sizes, times);
+  ASSERT_TRUE(fit.complexity == cpput::ON2);
+  ASSERT_FALSE(fit.exceedsBound());
+  fit.bound = cpput::ON;
+  ASSERT_TRUE(fit.exceedsBound());
+  fit.bound = cpput::ON2;
+  ASSERT_FALSE(fit.exceedsBound());
+}
+
+TEST(BenchmarkFamily, registers_every_size_of_geometric_range)
+{
+  const char* const names[] = { "sum_of_range/8", "sum_of_range/64", "sum_of_range/512", "sum_of_range/4096" };
+  for (std::size_t i = 0; i < 4; ++i)
+  {
+    cpput::Test* test = cpput::Repository::instance().find("Benchmark", names[i]);
+    ASSERT_TRUE(test != 0);
+    ASSERT_TRUE((test->getFlags() & cpput::Test::IsBenchmark) != 0);
+  }
+  ASSERT_TRUE(cpput::Repository::instance().find("Benchmark", "sum_of_range/32768") == 0);
+}
+
+TEST_SERIAL(BenchmarkFamily, fits_selected_sizes_and_reports_declared_bound)
+{
+  cpput::Options options;
+  options.benchmarks = true;
+  options.benchmark.minTime = 0.001;
+  options.benchmark.repetitions = 3;
+
+  options.filter = "Benchmark.sum_of_range/8:Benchmark.sum_of_range/64";
+  ComplexityRecordingWriter writer;
+  ASSERT_EQ(0, cpput::runAllTests(writer, options));
+  ASSERT_EQ(3u, writer.names_.size());
+  ASSERT_EQ(std::string("Benchmark.sum_of_range/BigO"), writer.names_[2]);
+  ASSERT_EQ(1u, writer.complexities_.size());
+  ASSERT_TRUE(writer.complexities_[0].bound == cpput::OAny);
+
+  // Whether the measured times exceed the bound depends on the machine;
+  // that decision is checked on fixed times in fitComplexity's tests.
+  options.filter = "BenchmarkSubject.*";
+  ComplexityRecordingWriter subject;
+  cpput::runAllTests(subject, options);
+  ASSERT_EQ(1u, subject.complexities_.size());
+  ASSERT_EQ(std::string("quadratic_within_linear_bound/BigO"), subject.complexities_[0].name);
+  ASSERT_TRUE(subject.complexities_[0].bound == cpput::ON);
+}
+
+namespace
+{
+
+struct ComparisonRecordingWriter : public NameRecordingWriter
+{
+  virtual void comparison(const cpput::ComparisonResult& result) { comparisons_.push_back(result); }
+
+  std::vector<cpput::ComparisonResult> comparisons_;
+};
+
+} // namespace
+
+BENCHMARK(Benchmark, sum_of_vector_twice)
+{
+  std::vector<int> values(64, 1);
+  while (state.keepRunning())
+  {
+    int sum = 0;
+    for (int pass = 0; pass < 2; ++pass)
+      for (std::size_t i = 0; i < values.size(); ++i)
+        sum += values[i];
+    cpput::doNotOptimize(sum);
+  }
+  ASSERT_EQ(64u, values.size());
+}
+
+BENCHMARK_COMPARE(Benchmark, sum_of_vector_twice, sum_of_vector);
+
+TEST(complementaryErrorFunction, matches_tabulated_values)
+{
+  ASSERT_NEAR(1.0, cpput::complementaryErrorFunction(0), 1e-7);
+  ASSERT_NEAR(0.4795001222, cpput::complementaryErrorFunction(0.5), 1e-7);
+  ASSERT_NEAR(0.1572992071, cpput::complementaryErrorFunction(1), 1e-7);
+  ASSERT_NEAR(1.8427007929, cpput::complementaryErrorFunction(-1), 1e-7);
+  ASSERT_NEAR(2.209049700e-5, cpput::complementaryErrorFunction(3), 1e-10);
+}
+
+TEST(mannWhitneyPValue, separates_shifted_samples)
+{
+  std::vector<double> low;
+  std::vector<double> high;
+  for (int i = 0; i < 10; ++i)
+  {
+    low.push_back(i);
+    high.push_back(i + 100);
+  }
+  ASSERT_TRUE(cpput::mannWhitneyPValue(low, high) < 0.001);
+  ASSERT_TRUE(cpput::mannWhitneyPValue(low, low) > 0.9);
+  ASSERT_NEAR(1.0, cpput::mannWhitneyPValue(low, std::vector<double>()), 1e-9);
+
+  // Interleaved samples with equal rank sums.
+  std::vector<double> outer;
+  outer.push_back(1);
+  outer.push_back(4);
+  std::vector<double> inner;
+  inner.push_back(2);
+  inner.push_back(3);
+  ASSERT_TRUE(cpput::mannWhitneyPValue(outer, inner) <= 1);
+}
+
+TEST(compareSamples, reports_speedup_with_confidence_interval)
+{
+  std::vector<double> baseline;
+  std::vector<double> candidate;
+  for (int i = 0; i < 20; ++i)
+  {
+    baseline.push_back(2.0 + (i % 5) * 0.01);
+    candidate.push_back(1.0 + (i % 5) * 0.01);
+  }
+  const cpput::ComparisonResult result = cpput::compareSamples(baseline, candidate);
+  ASSERT_EQ(20u, result.rounds);
+  ASSERT_NEAR(2.02 / 1.02, result.speedup, 1e-9);
+  ASSERT_TRUE(result.speedupLow <= result.speedup);
+  ASSERT_TRUE(result.speedupHigh >= result.speedup);
+  ASSERT_TRUE(result.speedupLow > 1.9);
+  ASSERT_TRUE(result.significant());
+
+  const cpput::ComparisonResult same = cpput::compareSamples(baseline, baseline);
+  ASSERT_NEAR(1.0, same.speedup, 1e-9);
+  ASSERT_FALSE(same.significant());
+
+  const cpput::ComparisonResult slower = cpput::compareSamples(candidate, baseline);
+  ASSERT_NEAR(1.02 / 2.02, slower.speedup, 1e-9);
+  ASSERT_TRUE(slower.speedupHigh < 0.6);
+  ASSERT_TRUE(slower.significant());
+}
+
+TEST_SERIAL(BenchmarkComparison, interleaves_and_reports_speedup)
+{
+  cpput::Test* comparison = cpput::Repository::instance().find("Benchmark", "sum_of_vector_twice_vs_sum_of_vector");
+  ASSERT_TRUE(comparison != 0);
+
+  const BenchmarkSettingsGuard guard(3);
+  ComparisonRecordingWriter writer;
+  comparison->run(writer);
+
+  // How much faster the candidate is depends on the machine; the speedup
+  // itself is checked on fixed samples in compareSamples' test.
+  ASSERT_EQ(1u, writer.comparisons_.size());
+  const cpput::ComparisonResult& result = writer.comparisons_[0];
+  ASSERT_EQ(std::string("Benchmark"), result.className);
+  ASSERT_EQ(std::string("sum_of_vector_twice_vs_sum_of_vector"), result.name);
+  ASSERT_EQ(std::string("sum_of_vector_twice"), result.baseline);
+  ASSERT_EQ(std::string("sum_of_vector"), result.candidate);
+  ASSERT_EQ(cpput::BenchmarkComparison::rounds(3), result.rounds);
+  ASSERT_TRUE(result.baselineTime.median > 0);
+  ASSERT_TRUE(result.candidateTime.median > 0);
+  ASSERT_TRUE(result.speedupLow > 0);
+  ASSERT_TRUE(result.speedupLow <= result.speedupHigh);
+  ASSERT_TRUE(result.pValue >= 0 && result.pValue <= 1);
+}
+
+TEST_SERIAL(BenchmarkComparison, warms_up_both_sides)
+{
+  cpput::Test* comparison = cpput::Repository::instance().find("Benchmark", "sum_of_vector_twice_vs_sum_of_vector");
+  ASSERT_TRUE(comparison != 0);
+
+  // A warmup that never settles runs for the whole warmup time on each side.
+  const BenchmarkSettingsGuard guard(1);
+  cpput::Benchmark::settings().warmupThreshold = 1e-12;
+  cpput::Benchmark::settings().maxWarmupTime = 0.05;
+  const cpput::BenchmarkClock& clock = cpput::BenchmarkClock::instance();
+  ComparisonRecordingWriter writer;
+  const uint64_t start = clock.now();
+  comparison->run(writer);
+  ASSERT_TRUE(clock.toSeconds(clock.now() - start) >= 0.1);
+  ASSERT_EQ(1u, writer.comparisons_.size());
+}
+
+namespace
+{
+
+cpput::BenchmarkResult benchmarkResult(const char* name, double median, double stddev)
+{
+  cpput::BenchmarkResult result;
+  result.className = "Baseline";
+  result.name = name;
+  result.time.median = median;
+  result.time.stddev = stddev;
+  return result;
+}
+
+/// Names a file after the running process so that concurrently running
+/// test processes do not share it.
+std::string temporaryPath(const char* name)
+{
+  std::ostringstream path;
+  path << name << '.' << getpid() << ".txt";
+  return path.str();
+}
+
+} // namespace
+
+TEST(BenchmarkBaseline, saves_and_loads_versioned_file)
+{
+  const std::string path = temporaryPath("cpput_baseline_roundtrip");
+  cpput::BenchmarkBaseline saved;
+  saved.add(benchmarkResult("a", 1.5e-6, 2e-8));
+  saved.add(benchmarkResult("b/64", 3e-9, 0));
+  ASSERT_TRUE(saved.save(path));
+
+  cpput::BenchmarkBaseline loaded;
+  ASSERT_TRUE(loaded.load(path));
+  ASSERT_EQ(2u, loaded.size());
+  ASSERT_TRUE(loaded.find("Baseline.a") != 0);
+  ASSERT_NEAR(1.5e-6, loaded.find("Baseline.a")->median, 1e-15);
+  ASSERT_NEAR(2e-8, loaded.find("Baseline.a")->stddev, 1e-15);
+  ASSERT_NEAR(3e-9, loaded.find("Baseline.b/64")->median, 1e-18);
+
+  {
+    std::ofstream out(path.c_str());
+    out << "cpput-baseline 999\n";
+  }
+  cpput::BenchmarkBaseline future;
+  ASSERT_FALSE(future.load(path));
+  std::remove(path.c_str());
+  ASSERT_FALSE(future.load(path));
+}
+
+TEST(BenchmarkBaseline, flags_regressions_beyond_threshold_and_noise)
+{
+  cpput::BenchmarkBaseline baseline;
+  baseline.add(benchmarkResult("quiet", 100e-9, 0));
+  baseline.add(benchmarkResult("noisy", 100e-9, 10e-9));
+
+  ASSERT_TRUE(baseline.check(benchmarkResult("quiet", 109e-9, 0), 0.1).empty());
+  ASSERT_FALSE(baseline.check(benchmarkResult("quiet", 111e-9, 0), 0.1).empty());
+  ASSERT_TRUE(baseline.check(benchmarkResult("noisy", 125e-9, 0), 0.1).empty());
+  ASSERT_FALSE(baseline.check(benchmarkResult("noisy", 135e-9, 0), 0.1).empty());
+  ASSERT_TRUE(baseline.check(benchmarkResult("unknown", 1, 0), 0.1).empty());
+  ASSERT_TRUE(baseline.check(benchmarkResult("quiet", 111e-9, 0), 0.1).find("Regressed by 11%") == 0);
+}
+
+TEST(Options, parses_baseline_settings)
+{
+  char program[] = "unittests";
+  char benchmarks[] = "--benchmarks";
+  char save[] = "--save-baseline=new.txt";
+  char compare[] = "--compare-baseline=old.txt";
+  char threshold[] = "--regression-threshold=5";
+  char* argv[] = { program, benchmarks, save, compare, threshold };
+  cpput::Options options;
+  ASSERT_TRUE(options.parse(5, argv));
+  ASSERT_EQ(std::string("new.txt"), options.saveBaseline);
+  ASSERT_EQ(std::string("old.txt"), options.compareBaseline);
+  ASSERT_NEAR(0.05, options.benchmark.regressionThreshold, 1e-9);
+
+  // A baseline is only written or compared when benchmarks run.
+  cpput::Options testsOnly;
+  char* testsArgv[] = { program, save };
+  ASSERT_FALSE(testsOnly.parse(2, testsArgv));
+}
+
+TEST_SERIAL(runAllTests, restores_settings_it_changes)
+{
+  const unsigned timeout = cpput::Watchdog::instance().getDefaultTimeout();
+  const double minTime = cpput::Benchmark::settings().minTime;
+  const bool perfCounters = cpput::PerfProbe::enabled();
+  cpput::Options options;
+  options.timeout = timeout + 1000;
+  options.benchmark.minTime = minTime * 2;
+  options.perfCounters = !perfCounters;
+  options.filter = "no_such_group.*";
+
+  NameRecordingWriter writer;
+  ASSERT_EQ(0, cpput::runAllTests(writer, options));
+  ASSERT_EQ(timeout, cpput::Watchdog::instance().getDefaultTimeout());
+  ASSERT_NEAR(minTime, cpput::Benchmark::settings().minTime, 1e-12);
+  ASSERT_EQ(perfCounters, cpput::PerfProbe::enabled());
+}
+
+TEST_SERIAL(BenchmarkBaseline, gates_benchmark_run_on_regressions)
+{
+  const std::string path = temporaryPath("cpput_baseline_gate");
+  cpput::Options options;
+  options.benchmarks = true;
+  options.benchmark.minTime = 0.001;
+  options.benchmark.repetitions = 2;
+  options.filter = "Benchmark.sum_of_vector";
+  options.saveBaseline = path;
+
+  NameRecordingWriter first;
+  ASSERT_EQ(0, cpput::runAllTests(first, options));
+  cpput::BenchmarkBaseline baseline;
+  ASSERT_TRUE(baseline.load(path));
+  ASSERT_TRUE(baseline.find("Benchmark.sum_of_vector") != 0);
+
+  // A baseline a thousand times faster than reality must fail the gate.
+  cpput::BenchmarkResult fast;
+  fast.className = "Benchmark";
+  fast.name = "sum_of_vector";
+  fast.time.median = baseline.find("Benchmark.sum_of_vector")->median / 1000;
+  baseline.add(fast);
+  ASSERT_TRUE(baseline.save(path));
+
+  // One repetition has no spread, so noise of a loaded machine cannot
+  // widen the allowed time beyond the regression threshold.
+  options.saveBaseline.clear();
+  options.compareBaseline = path;
+  options.benchmark.repetitions = 1;
+  NameRecordingWriter second;
+  const int failures = cpput::runAllTests(second, options);
+  std::remove(path.c_str());
+
+  options.compareBaseline = temporaryPath("cpput_no_such_baseline");
+  NameRecordingWriter missing;
+  const int missingFailures = cpput::runAllTests(missing, options);
+
+  ASSERT_EQ(1, failures);
+  ASSERT_EQ(1, missingFailures);
+  ASSERT_EQ(0u, missing.names_.size());
+}
+
+#ifdef CPPUT_HAS_THREADS
+
+namespace
+{
+
+struct ScalingRecordingWriter : public BenchmarkRecordingWriter
+{
+  virtual void scaling(const cpput::ScalingResult& result) { scalings_.push_back(result); }
+
+  std::vector<cpput::ScalingResult> scalings_;
+};
+
+struct PaddedCounter
+{
+  std::size_t value;
+  char        padding[64 - sizeof(std::size_t)];
+};
+
+PaddedCounter threadCounters[4];
+pthread_t singleThread;
+
+void* waitAtBarrier(void* barrier)
+{
+  static_cast<cpput::Barrier*>(barrier)->wait();
+  return 0;
+}
+
+} // namespace
+
+TEST(Barrier, releases_waiting_threads_when_one_leaves)
+{
+  cpput::Barrier barrier(3);
+  pthread_t first;
+  pthread_t second;
+  ASSERT_EQ(0, pthread_create(&first, 0, &waitAtBarrier, &barrier));
+  ASSERT_EQ(0, pthread_create(&second, 0, &waitAtBarrier, &barrier));
+  barrier.leave();
+  ASSERT_EQ(0, pthread_join(first, 0));
+  ASSERT_EQ(0, pthread_join(second, 0));
+}
+
+BENCHMARK_THREADS(Benchmark, private_counters, 4)
+{
+  ASSERT_TRUE(state.threadIndex() < state.threads());
+  if (state.threads() == 1)
+    singleThread = pthread_self();
+  PaddedCounter& counter = threadCounters[state.threadIndex()];
+  while (state.keepRunning())
+  {
+    counter.value++;
+    cpput::clobberMemory();
+  }
+}
+
+TEST(computeScaling, reports_efficiency_and_negative_scaling)
+{
+  std::vector<std::size_t> threads;
+  std::vector<double> times;
+  threads.push_back(1);
+  times.push_back(1e-6);
+  threads.push_back(2);
+  times.push_back(1e-6);
+  threads.push_back(4);
+  times.push_back(4e-6);
+  // 1% below the previous count is within the noise.
+  threads.push_back(8);
+  times.push_back(8e-6 / 0.99);
+  const cpput::ScalingResult result = cpput::computeScaling(threads, times);
+  ASSERT_EQ(4u, result.points.size());
+  ASSERT_NEAR(1e6, result.points[0].throughput, 1e-3);
+  ASSERT_NEAR(2e6, result.points[1].throughput, 1e-3);
+  ASSERT_NEAR(1.0, result.points[1].efficiency, 1e-9);
+  ASSERT_FALSE(result.points[1].negative);
+  ASSERT_NEAR(1e6, result.points[2].throughput, 1e-3);
+  ASSERT_NEAR(0.25, result.points[2].efficiency, 1e-9);
+  ASSERT_TRUE(result.points[2].negative);
+  ASSERT_NEAR(0.99e6, result.points[3].throughput, 1e-3);
+  ASSERT_FALSE(result.points[3].negative);
+  ASSERT_TRUE(result.negativeScaling());
+}
+
+TEST(formatRate, picks_si_prefix)
+{
+  ASSERT_EQ(std::string("12.3 M/s"), cpput::formatRate(12.3e6));
+  ASSERT_EQ(std::string("1.5 GB/s"), cpput::formatRate(1.5e9, "B"));
+  ASSERT_EQ(std::string("500 /s"), cpput::formatRate(500));
+}
+
+TEST_SERIAL(BenchmarkFamily, runs_body_on_each_thread_count)
+{
+  ASSERT_TRUE(cpput::Repository::instance().find("Benchmark", "private_counters/threads_1") != 0);
+  ASSERT_TRUE(cpput::Repository::instance().find("Benchmark", "private_counters/threads_2") != 0);
+  ASSERT_TRUE(cpput::Repository::instance().find("Benchmark", "private_counters/threads_4") != 0);
+
+  cpput::Options options;
+  options.benchmarks = true;
+  options.benchmark.minTime = 0.001;
+  options.benchmark.repetitions = 2;
+  options.filter = "Benchmark.private_counters/*";
+  for (std::size_t i = 0; i < 4; ++i)
+    threadCounters[i].value = 0;
+  singleThread = pthread_self();
+
+  ScalingRecordingWriter writer;
+  const int failures = cpput::runAllTests(writer, options);
+
+  ASSERT_EQ(0, failures);
+  // A single thread is measured on a pinned thread of its own like the
+  // others, not on the calling thread.
+  ASSERT_FALSE(pthread_equal(singleThread, pthread_self()));
+  ASSERT_EQ(3u, writer.results_.size());
+  ASSERT_EQ(4u, writer.results_[2].threads);
+  for (std::size_t i = 0; i < 4; ++i)
+    ASSERT_TRUE(threadCounters[i].value > 0);
+  ASSERT_EQ(1u, writer.scalings_.size());
+  ASSERT_EQ(std::string("private_counters/scaling"), writer.scalings_[0].name);
+  ASSERT_EQ(3u, writer.scalings_[0].points.size());
+  ASSERT_EQ(2u, writer.scalings_[0].points[1].threads);
+}
+
+#endif
+
+namespace
+{
+
+struct LatencyRecordingWriter : public BenchmarkRecordingWriter
+{
+  virtual void latency(const cpput::LatencyResult& result) { latencies_.push_back(result); }
+
+  std::vector<cpput::LatencyResult> latencies_;
+};
+
+} // namespace
+
+BENCHMARK_LATENCY(Benchmark, vector_push_back)
+{
+  std::vector<int> values;
+  while (state.keepRunning())
+    values.push_back(1);
+  ASSERT_TRUE(values.size() >= state.iterations());
+}
+
+TEST(LatencyHistogram, keeps_values_within_bucket_precision)
+{
+  const uint64_t values[] = { 0, 1, 127, 128, 129, 255, 256, 1000, 123456789,
+                              static_cast<uint64_t>(1) << 40, ~static_cast<uint64_t>(0) };
+  for (std::size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i)
+  {
+    const std::size_t index = cpput::LatencyHistogram::indexOf(values[i]);
+    ASSERT_TRUE(index < cpput::LatencyHistogram::bucketCount);
+    const uint64_t highest = cpput::LatencyHistogram::highestEquivalent(index);
+    ASSERT_TRUE(highest >= values[i]);
+    ASSERT_TRUE(highest - values[i] <= values[i] / 64);
+    if (index > 0)
+      ASSERT_TRUE(cpput::LatencyHistogram::highestEquivalent(index - 1) < values[i]);
+  }
+}
+
+TEST(LatencyHistogram, reports_percentiles)
+{
+  cpput::LatencyHistogram histogram;
+  for (uint64_t v = 1; v <= 100; ++v)
+    histogram.record(v);
+  histogram.record(100000);
+  ASSERT_EQ(101u, histogram.count());
+  ASSERT_EQ(1u, histogram.min());
+  ASSERT_EQ(100000u, histogram.max());
+  ASSERT_EQ(51u, histogram.percentile(50));
+  ASSERT_EQ(91u, histogram.percentile(90));
+  ASSERT_EQ(100000u, histogram.percentile(100));
+
+  cpput::LatencyHistogram other;
+  other.record(5, 3);
+  histogram.add(other);
+  ASSERT_EQ(104u, histogram.count());
+}
+
+TEST(LatencyHistogram, corrects_coordinated_omission)
+{
+  cpput::LatencyHistogram histogram;
+  histogram.recordCorrected(100, 100);
+  ASSERT_EQ(1u, histogram.count());
+  histogram.recordCorrected(1000, 100);
+  // The stall hid requests that would have waited 900, 800, ... 100.
+  ASSERT_EQ(11u, histogram.count());
+  ASSERT_EQ(100u, histogram.min());
+  ASSERT_EQ(1000u, histogram.max());
+}
+
+TEST_SERIAL(LatencyBenchmark, records_every_iteration)
+{
+  cpput::Test* benchmark = cpput::Repository::instance().find("Benchmark", "vector_push_back");
+  ASSERT_TRUE(benchmark != 0);
+
+  const BenchmarkSettingsGuard guard(2);
+  LatencyRecordingWriter writer;
+  benchmark->run(writer);
+
+  ASSERT_EQ(0, writer.getNumberOfFailures());
+  ASSERT_EQ(1u, writer.results_.size());
+  ASSERT_EQ(1u, writer.latencies_.size());
+  const cpput::LatencyResult& latency = writer.latencies_[0];
+  ASSERT_EQ(writer.results_[0].iterations * 2, latency.count);
+  ASSERT_FALSE(latency.corrected);
+  ASSERT_TRUE(latency.p50 <= latency.p90);
+  ASSERT_TRUE(latency.p99 <= latency.p999);
+  ASSERT_TRUE(latency.p999 <= latency.max);
+  ASSERT_TRUE(latency.max > 0);
+}
+
+TEST(BenchmarkClock, measures_elapsed_time_without_its_overhead)
+{
+  const cpput::BenchmarkClock& clock = cpput::BenchmarkClock::instance();
+  const std::string name = clock.name();
+  ASSERT_EQ(std::string(cpput::BenchmarkClock::tscAvailable() ? "tsc" : "clock_gettime"), name);
+  const uint64_t first = clock.now();
+  const uint64_t second = clock.now();
+  ASSERT_TRUE(second >= first);
+  ASSERT_EQ(0u, clock.elapsed(first, first + clock.overhead()));
+
+  const uint64_t start = clock.now();
+  usleep(10000);
+  const double seconds = clock.toSeconds(clock.elapsed(start, clock.now()));
+  ASSERT_TRUE(seconds >= 0.009);
+  ASSERT_TRUE(seconds < 1);
+}
+
+TEST(BenchmarkState, rounds_batched_iterations_up_to_whole_batches)
+{
+  cpput::BenchmarkState state(10);
+  std::size_t turns = 0;
+  while (state.keepRunningBatch(4))
+    turns++;
+  ASSERT_EQ(3u, turns);
+  ASSERT_EQ(12u, state.iterations());
+  ASSERT_TRUE(state.finished());
+
+  cpput::LatencyHistogram histogram;
+  cpput::BenchmarkState latency(8, 0, 0, 1, &histogram);
+  turns = 0;
+  while (latency.keepRunningBatch(2))
+    turns++;
+  ASSERT_EQ(4u, turns);
+  ASSERT_EQ(8u, histogram.count());
+}
+
+// ----------------------------------------------------------------------------
+// Hardware counters
+
+namespace
+{
+
+void assertFewCacheMisses(cpput::Result& testResult_, const cpput::PerfCounters& counters)
+{
+  ASSERT_COUNTER_LT(counters, CacheMisses, 1.0);
+}
+
+} // namespace
+
+TEST(PerfCounters, scales_available_counters)
+{
+  cpput::PerfCounters counters;
+  ASSERT_FALSE(counters.has(cpput::PerfCounters::Instructions));
+  counters.set(cpput::PerfCounters::Instructions, 1000);
+  counters.set(cpput::PerfCounters::CacheMisses, 10);
+  ASSERT_TRUE(counters.has(cpput::PerfCounters::Instructions | cpput::PerfCounters::CacheMisses));
+  ASSERT_FALSE(counters.has(cpput::PerfCounters::Instructions | cpput::PerfCounters::Cycles));
+
+  const cpput::PerfCounters perElement = counters.per(100);
+  ASSERT_NEAR(10.0, perElement.instructions, 1e-9);
+  ASSERT_NEAR(0.1, perElement.get(cpput::PerfCounters::CacheMisses), 1e-9);
+  ASSERT_EQ(counters.available, perElement.available);
+}
+
+TEST(PerfProbe, counts_a_loop_where_the_hardware_allows)
+{
+  std::vector<int> values(1 << 16, 1);
+  cpput::PerfProbe probe;
+  probe.start();
+  int sum = 0;
+  for (std::size_t i = 0; i < values.size(); ++i)
+    sum += values[i];
+  cpput::doNotOptimize(sum);
+  const cpput::PerfCounters counters = probe.read().per(static_cast<double>(values.size()));
+
+  if (counters.has(cpput::PerfCounters::Instructions))
+    ASSERT_TRUE(counters.instructions > 1);
+  ASSERT_COUNTER_LT(counters, LlcMisses, 1.0);
+  ASSERT_COUNTER_LT(counters, BranchMisses, 0.5);
+}
+
+TEST(ASSERT_COUNTER_LT, fails_only_for_measured_counters_at_limit)
+{
+  cpput::PerfCounters counters;
+  NameRecordingWriter unavailable;
+  {
+    cpput::Result result("group", "name", unavailable);
+    assertFewCacheMisses(result, counters);
+  }
+  ASSERT_EQ(0, unavailable.getNumberOfFailures());
+
+  counters.set(cpput::PerfCounters::CacheMisses, 2);
+  NameRecordingWriter measured;
+  {
+    cpput::Result result("group", "name", measured);
+    assertFewCacheMisses(result, counters);
+  }
+  ASSERT_EQ(1, measured.getNumberOfFailures());
+}
+
+TEST(Options, parses_perf_counters)
+{
+  char program[] = "unittests";
+  char perf[] = "--perf-counters";
+  char* argv[] = { program, perf };
+  cpput::Options options;
+  ASSERT_FALSE(options.perfCounters);
+  ASSERT_TRUE(options.parse(2, argv));
+  ASSERT_TRUE(options.perfCounters);
+}
+
+// ----------------------------------------------------------------------------
+// Cold caches
+
+BENCHMARK_COLD(Benchmark, sum_of_flushed_vector)
+{
+  std::vector<int> values(16384, 1);
+  state.addColdRegion(&values[0], values.size() * sizeof(values[0]));
+  int sum = 0;
+  while (state.keepRunning())
+  {
+    sum = 0;
+    for (std::size_t i = 0; i < values.size(); ++i)
+      sum += values[i];
+    cpput::doNotOptimize(sum);
+  }
+  ASSERT_EQ(16384, sum);
+}
+
+TEST(BenchmarkState, evicts_registered_regions_between_iterations)
+{
+  std::vector<char> buffer(4096);
+  std::vector<char> evictionBuffer(256);
+  cpput::BenchmarkState state(5);
+  state.setColdCache(&evictionBuffer);
+  state.addColdRegion(&buffer[0], buffer.size());
+  std::size_t turns = 0;
+  while (state.keepRunning())
+    turns++;
+  ASSERT_EQ(5u, turns);
+  ASSERT_TRUE(state.finished());
+  ASSERT_TRUE(state.elapsed() >= 0);
+}
+
+TEST(BenchmarkState, evicts_through_its_own_buffer_without_regions)
+{
+  std::vector<char> evictionBuffer(256);
+  cpput::BenchmarkState state(3);
+  state.setColdCache(&evictionBuffer);
+  while (state.keepRunning())
+    ;
+  ASSERT_EQ(3, evictionBuffer[0]);
+  ASSERT_EQ(3, evictionBuffer[192]);
+  ASSERT_EQ(0, evictionBuffer[1]);
+}
+
+TEST_SERIAL(Benchmark, reports_warm_and_cold_cache_times)
+{
+  cpput::Test* benchmark = cpput::Repository::instance().find("Benchmark", "sum_of_flushed_vector");
+  ASSERT_TRUE(benchmark != 0);
+
+  const BenchmarkSettingsGuard guard(2);
+  BenchmarkRecordingWriter writer;
+  benchmark->run(writer);
+
+  ASSERT_EQ(0, writer.getNumberOfFailures());
+  ASSERT_EQ(1u, writer.results_.size());
+  const cpput::BenchmarkResult& result = writer.results_[0];
+  ASSERT_TRUE(result.iterations > 1);
+  ASSERT_TRUE(result.coldIterations >= 1);
+  ASSERT_TRUE(result.coldTime.min > 0);
+  ASSERT_TRUE(result.coldTime.min <= result.coldTime.median);
+}
+
+TEST(Options, parses_cold_cache)
+{
+  char program[] = "unittests";
+  char cold[] = "--cold-cache";
+  char* argv[] = { program, cold };
+  cpput::Options options;
+  ASSERT_FALSE(options.benchmark.coldCache);
+  ASSERT_TRUE(options.parse(2, argv));
+  ASSERT_TRUE(options.benchmark.coldCache);
+}
+
+// ----------------------------------------------------------------------------
+// Throughput
+
+namespace
+{
+
+void declareProcessed(cpput::Result& testResult_)
+{
+  SET_BYTES_PROCESSED(4096);
+  SET_ITEMS_PROCESSED(16);
+}
+
+} // namespace
+
+BENCHMARK(Benchmark, copy_bytes)
+{
+  std::vector<char> from(4096, 'x');
+  std::vector<char> to(from.size());
+  while (state.keepRunning())
+  {
+    std::copy(from.begin(), from.end(), to.begin());
+    cpput::clobberMemory();
+  }
+  state.setBytesProcessed(static_cast<double>(state.iterations()) * from.size());
+  state.setItemsProcessed(static_cast<double>(state.iterations()));
+  ASSERT_EQ('x', to[0]);
+}
+
+TEST(Result, reports_processed_bytes_and_items)
+{
+  MetricsRecordingWriter writer;
+  {
+    cpput::Result result("group", "name", writer);
+    declareProcessed(result);
+  }
+  ASSERT_NEAR(4096.0, writer.metrics_.bytesProcessed, 1e-9);
+  ASSERT_NEAR(16.0, writer.metrics_.itemsProcessed, 1e-9);
+}
+
+TEST_SERIAL(Benchmark, reports_throughput_at_median_time)
+{
+  cpput::Test* benchmark = cpput::Repository::instance().find("Benchmark", "copy_bytes");
+  ASSERT_TRUE(benchmark != 0);
+
+  const BenchmarkSettingsGuard guard(2);
+  BenchmarkRecordingWriter writer;
+  benchmark->run(writer);
+
+  ASSERT_EQ(1u, writer.results_.size());
+  const cpput::BenchmarkResult& result = writer.results_[0];
+  ASSERT_NEAR(4096.0 / result.time.median, result.bytesPerSecond, result.bytesPerSecond * 1e-9);
+  ASSERT_NEAR(1.0 / result.time.median, result.itemsPerSecond, result.itemsPerSecond * 1e-9);
+
+  writer.results_.clear();
+  benchmark = cpput::Repository::instance().find("Benchmark", "sum_of_vector");
+  ASSERT_TRUE(benchmark != 0);
+  benchmark->run(writer);
+  ASSERT_EQ(1u, writer.results_.size());
+  ASSERT_NEAR(0.0, writer.results_[0].bytesPerSecond, 1e-9);
+}
+
+// ----------------------------------------------------------------------------
+// Warmup
+
+TEST_SERIAL(Benchmark, warms_up_until_timing_is_steady)
+{
+  cpput::Test* benchmark = cpput::Repository::instance().find("Benchmark", "sum_of_vector");
+  ASSERT_TRUE(benchmark != 0);
+
+  const BenchmarkSettingsGuard guard(2);
+  cpput::Benchmark::settings().warmupThreshold = 1;
+  BenchmarkRecordingWriter writer;
+  benchmark->run(writer);
+
+  ASSERT_EQ(1u, writer.results_.size());
+  const cpput::BenchmarkResult& result = writer.results_[0];
+  ASSERT_TRUE(result.steady);
+  ASSERT_TRUE(result.warmupIterations > 0);
+  ASSERT_TRUE(result.warmupTime > 0);
+  ASSERT_EQ(2u, result.repetitions);
+}
+
+TEST_SERIAL(Benchmark, stops_warmup_at_time_limit)
+{
+  cpput::Test* benchmark = cpput::Repository::instance().find("Benchmark", "sum_of_vector");
+  ASSERT_TRUE(benchmark != 0);
+
+  const BenchmarkSettingsGuard guard(2);
+  cpput::Benchmark::settings().warmupThreshold = 1e-12;
+  cpput::Benchmark::settings().maxWarmupTime = 0.002;
+  BenchmarkRecordingWriter writer;
+  benchmark->run(writer);
+  cpput::Benchmark::settings().warmupThreshold = 0;
+  benchmark->run(writer);
+
+  ASSERT_EQ(2u, writer.results_.size());
+  ASSERT_FALSE(writer.results_[0].steady);
+  ASSERT_TRUE(writer.results_[0].warmupTime >= 0.002);
+  ASSERT_TRUE(writer.results_[0].warmupTime < 1);
+  ASSERT_EQ(0u, writer.results_[1].warmupIterations);
+  ASSERT_TRUE(writer.results_[1].steady);
+}
+
+TEST(Options, parses_warmup_settings)
+{
+  char program[] = "unittests";
+  char threshold[] = "--warmup-threshold=2";
+  char maxWarmup[] = "--max-warmup=0.5";
+  char* argv[] = { program, threshold, maxWarmup };
+  cpput::Options options;
+  ASSERT_NEAR(0.05, options.benchmark.warmupThreshold, 1e-9);
+  ASSERT_TRUE(options.parse(3, argv));
+  ASSERT_NEAR(0.02, options.benchmark.warmupThreshold, 1e-9);
+  ASSERT_NEAR(0.5, options.benchmark.maxWarmupTime, 1e-9);
+}
+
+// ----------------------------------------------------------------------------
+// Noise guard
+
+TEST(parseCpuList, expands_ranges_in_order)
+{
+  std::vector<int> cpus;
+  ASSERT_TRUE(cpput::parseCpuList("6,0-2,1", cpus));
+  ASSERT_EQ(4u, cpus.size());
+  ASSERT_EQ(0, cpus[0]);
+  ASSERT_EQ(2, cpus[2]);
+  ASSERT_EQ(6, cpus[3]);
+  ASSERT_FALSE(cpput::parseCpuList("", cpus));
+  ASSERT_FALSE(cpput::parseCpuList("3-1", cpus));
+  ASSERT_FALSE(cpput::parseCpuList("1,x", cpus));
+  ASSERT_FALSE(cpput::parseCpuList("-1", cpus));
+}
+
+TEST_SERIAL(pinToCpus, restricts_to_allowed_cpus)
+{
+  const std::vector<int> allowed = cpput::allowedCpus();
+  ASSERT_FALSE(allowed.empty());
+  const std::vector<int> first(1, allowed[0]);
+  ASSERT_TRUE(cpput::pinToCpus(first));
+  const std::vector<int> pinned = cpput::allowedCpus();
+  ASSERT_TRUE(cpput::pinToCpus(allowed));
+  ASSERT_EQ(1u, pinned.size());
+  ASSERT_EQ(allowed[0], pinned[0]);
+}
+
+#ifdef CPPUT_HAS_AFFINITY
+
+namespace
+{
+
+double secondsOf(clockid_t clock)
+{
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+} // namespace
+
+TEST_SERIAL(SystemLoad, does_not_count_own_cpu_time)
+{
+  cpu_set_t saved;
+  ASSERT_EQ(0, sched_getaffinity(0, sizeof(saved), &saved));
+  const int cpu = cpput::allowedCpus()[0];
+  cpu_set_t one;
+  CPU_ZERO(&one);
+  CPU_SET(cpu, &one);
+  ASSERT_EQ(0, sched_setaffinity(0, sizeof(one), &one));
+
+  // Keep the one CPU busy for 200 ms.
+  cpput::SystemLoad load(std::vector<int>(1, cpu));
+  load.start();
+  const double wallStart = secondsOf(CLOCK_MONOTONIC);
+  const double cpuStart = secondsOf(CLOCK_PROCESS_CPUTIME_ID);
+  double wall = 0;
+  while (wall < 0.2)
+    wall = secondsOf(CLOCK_MONOTONIC) - wallStart;
+  const double own = (secondsOf(CLOCK_PROCESS_CPUTIME_ID) - cpuStart) / wall;
+  const double other = load.otherLoad();
+  sched_setaffinity(0, sizeof(saved), &saved);
+
+  ASSERT_TRUE(other >= 0);
+  ASSERT_TRUE(other <= 1);
+  // Counted as another process's time, the loop would show up as a load
+  // close to its own share. If other processes took the CPU from the loop
+  // there is nothing to tell apart.
+  if (own > 0.8)
+    ASSERT_TRUE(other < own / 2);
+}
+
+#endif
+
+TEST(Options, parses_noise_guard_settings)
+{
+  char program[] = "unittests";
+  char cpus[] = "--benchmark-cpus=0-1";
+  char threshold[] = "--noise-threshold=20";
+  char* argv[] = { program, cpus, threshold };
+  cpput::Options options;
+  ASSERT_TRUE(options.parse(3, argv));
+  ASSERT_EQ(2u, options.benchmarkCpus.size());
+  ASSERT_NEAR(0.2, options.benchmark.noiseThreshold, 1e-9);
+
+  char invalid[] = "--benchmark-cpus=2-1";
+  char* invalidArgv[] = { program, invalid };
+  ASSERT_FALSE(options.parse(2, invalidArgv));
+}
+
+// ----------------------------------------------------------------------------
+// Allocation counting
+
+BENCHMARK(Benchmark, allocate_int)
+{
+  while (state.keepRunning())
+  {
+    int* value = new int(1);
+    cpput::doNotOptimize(value);
+    delete value;
+  }
+  ASSERT_TRUE(state.finished());
+}
+
+TEST(BenchmarkState, counts_allocations_of_the_loop)
+{
+  ASSERT_TRUE(cpput::AllocationCounter::installed());
+  std::vector<char*> buffers;
+  buffers.reserve(3);
+  cpput::BenchmarkState state(3);
+  while (state.keepRunning())
+    buffers.push_back(new char[100]);
+  for (std::size_t i = 0; i < buffers.size(); ++i)
+    delete[] buffers[i];
+  ASSERT_EQ(3u, state.allocations());
+  ASSERT_EQ(300u, state.allocatedBytes());
+}
+
+TEST_SERIAL(Benchmark, reports_allocations_per_iteration)
+{
+  cpput::Test* benchmark = cpput::Repository::instance().find("Benchmark", "allocate_int");
+  ASSERT_TRUE(benchmark != 0);
+
+  const BenchmarkSettingsGuard guard(2);
+  BenchmarkRecordingWriter writer;
+  benchmark->run(writer);
+
+  ASSERT_EQ(1u, writer.results_.size());
+  const cpput::BenchmarkResult& result = writer.results_[0];
+  ASSERT_TRUE(result.allocationsCounted);
+  ASSERT_NEAR(1.0, result.allocations, 1e-9);
+  ASSERT_NEAR(double(sizeof(int)), result.allocatedBytes, 1e-9);
+}
+
+// ----------------------------------------------------------------------------
+// Benchmark fixtures
+
+namespace
+{
+
+struct ShuffledInput : public cpput::BenchmarkFixture
+{
+  virtual void setUp(cpput::BenchmarkState&)
+  {
+    for (int i = 0; i < 256; ++i)
+      input.push_back(i);
+    setUps++;
+  }
+
+  virtual void tearDown(cpput::BenchmarkState&)
+  {
+    tearDowns++;
+  }
+
+  std::vector<int> input;
+  static int setUps;
+  static int tearDowns;
+};
+
+int ShuffledInput::setUps = 0;
+int ShuffledInput::tearDowns = 0;
+
+} // namespace
+
+BENCHMARK_F(ShuffledInput, sort)
+{
+  std::vector<int> values;
+  while (state.keepRunning())
+  {
+    state.pauseTiming();
+    values = input;
+    std::reverse(values.begin(), values.end());
+    state.resumeTiming();
+    std::sort(values.begin(), values.end());
+  }
+  ASSERT_EQ(256u, input.size());
+}
+
+TEST(BenchmarkState, excludes_paused_time_and_allocations)
+{
+  cpput::BenchmarkState state(5);
+  std::vector<char*> buffers;
+  buffers.reserve(5);
+  while (state.keepRunning())
+  {
+    state.pauseTiming();
+    buffers.push_back(new char[10]);
+    usleep(2000);
+    state.resumeTiming();
+  }
+  for (std::size_t i = 0; i < buffers.size(); ++i)
+    delete[] buffers[i];
+  ASSERT_TRUE(state.elapsed() < 0.005);
+  ASSERT_EQ(0u, state.allocations());
+}
+
+TEST(BenchmarkState, resumes_timing_paused_at_end_of_loop)
+{
+  cpput::BenchmarkState state(3);
+  std::size_t turns = 0;
+  while (state.keepRunning())
+  {
+    turns++;
+    state.pauseTiming();
+    usleep(2000);
+  }
+  ASSERT_EQ(3u, turns);
+  ASSERT_TRUE(state.finished());
+  ASSERT_TRUE(state.elapsed() < 0.003);
+}
+
+TEST_SERIAL(Benchmark, runs_fixture_set_up_and_tear_down_for_every_run)
+{
+  cpput::Test* benchmark = cpput::Repository::instance().find("ShuffledInput", "sort");
+  ASSERT_TRUE(benchmark != 0);
+
+  const BenchmarkSettingsGuard guard(2);
+  ShuffledInput::setUps = ShuffledInput::tearDowns = 0;
+  BenchmarkRecordingWriter writer;
+  benchmark->run(writer);
+
+  ASSERT_EQ(0, writer.getNumberOfFailures());
+  ASSERT_EQ(1u, writer.results_.size());
+  ASSERT_TRUE(ShuffledInput::setUps >= 2);
+  ASSERT_EQ(ShuffledInput::setUps, ShuffledInput::tearDowns);
+  ASSERT_NEAR(0.0, writer.results_[0].allocations, 1e-9);
+}
+
+// ----------------------------------------------------------------------------
+// Allocators
+
+namespace
+{
+
+struct AllocatorsRecordingWriter : public BenchmarkRecordingWriter
+{
+  virtual void allocators(const cpput::AllocatorsResult& result) { allocators_.push_back(result); }
+
+  std::vector<cpput::AllocatorsResult> allocators_;
+};
+
+} // namespace
+
+BENCHMARK_ALLOCATORS(Benchmark, temporary_vector)
+{
+  while (state.keepRunning())
+  {
+    std::vector<int> values(64, 1);
+    cpput::doNotOptimize(values[0]);
+  }
+  ASSERT_TRUE(state.finished());
+}
+
+TEST(BenchmarkState, resets_arena_after_every_iteration)
+{
+  std::vector<int*> values;
+  values.reserve(4);
+  {
+    cpput::BenchmarkState state(4);
+    state.setAllocator(cpput::ArenaAllocator);
+    while (state.keepRunning())
+    {
+      values.push_back(new int(1));
+      delete values.back();
+    }
+  }
+  ASSERT_EQ(4u, values.size());
+  ASSERT_TRUE(cpput::BenchmarkArena::owns(values[0]));
+  ASSERT_TRUE(values[0] == values[3]);
+  ASSERT_TRUE(cpput::BenchmarkArena::current() == 0);
+
+  int* outside = new int(2);
+  ASSERT_FALSE(cpput::BenchmarkArena::owns(outside));
+  delete outside;
+}
+
+namespace
+{
+
+struct FailureTextWriter : public NameRecordingWriter
+{
+  virtual void failure(const std::string&, std::size_t, const std::string& message)
+  {
+    messages_.push_back(message);
+  }
+
+  std::vector<std::string> messages_;
+};
+
+void failInArenaLoop(cpput::Result& testResult_, cpput::BenchmarkState& state)
+{
+  while (state.keepRunning())
+    ASSERT_EQ(1, 2);
+}
+
+} // namespace
+
+TEST_SERIAL(BenchmarkState, keeps_failures_of_arena_loop_after_reset)
+{
+  FailureTextWriter writer;
+  {
+    cpput::Result result("Benchmark", "failing", writer);
+    cpput::BenchmarkState state(4);
+    state.setAllocator(cpput::ArenaAllocator);
+    failInArenaLoop(result, state);
+  }
+  ASSERT_TRUE(cpput::BenchmarkArena::current() == 0);
+
+  // The next arena benchmark reuses the memory of the failed one.
+  {
+    cpput::BenchmarkState state(4);
+    state.setAllocator(cpput::ArenaAllocator);
+    while (state.keepRunning())
+    {
+      std::string filler(4096, 'x');
+      cpput::doNotOptimize(filler[0]);
+    }
+  }
+  ASSERT_EQ(1u, writer.messages_.size());
+  ASSERT_EQ(std::string("failed comparison, expected 1 got 2\n"), writer.messages_[0]);
+}
+
+TEST_SERIAL(BenchmarkFamily, compares_allocators_side_by_side)
+{
+  ASSERT_TRUE(cpput::Repository::instance().find("Benchmark", "temporary_vector/malloc") != 0);
+  ASSERT_TRUE(cpput::Repository::instance().find("Benchmark", "temporary_vector/arena") != 0);
+  ASSERT_TRUE(cpput::Repository::instance().find("Benchmark", "temporary_vector/huge_pages") != 0);
+
+  cpput::Options options;
+  options.benchmarks = true;
+  options.benchmark.minTime = 0.001;
+  options.benchmark.repetitions = 2;
+  options.filter = "Benchmark.temporary_vector/*";
+
+  AllocatorsRecordingWriter writer;
+  const int failures = cpput::runAllTests(writer, options);
+
+  ASSERT_EQ(0, failures);
+  ASSERT_EQ(3u, writer.results_.size());
+  ASSERT_NEAR(1.0, writer.results_[1].allocations, 1e-9);
+  ASSERT_EQ(1u, writer.allocators_.size());
+  const cpput::AllocatorsResult& result = writer.allocators_[0];
+  ASSERT_EQ(std::string("temporary_vector/allocators"), result.name);
+  ASSERT_EQ(3u, result.allocators.size());
+  ASSERT_EQ(cpput::MallocAllocator, result.allocators[0]);
+  ASSERT_EQ(cpput::HugePageAllocator, result.allocators[2]);
+  ASSERT_NEAR(1.0, result.speedup(0), 1e-9);
+  ASSERT_TRUE(result.speedup(1) > 0);
+}
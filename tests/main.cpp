@@ -1,2 +1,3 @@
+#define CPPUT_COUNT_ALLOCATIONS
 #include "../TestHarness.hpp"
 CPPUT_TEST_MAIN